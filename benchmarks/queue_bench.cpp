@@ -0,0 +1,79 @@
+#include <enji/common.h>
+#include <chrono>
+#include <iomanip>
+
+using enji::SafeQueue;
+using enji::RingQueue;
+
+//
+// Producers push `items` values each, one consumer pops them all,
+// like workers feeding an event loop output queue
+//
+
+const size_t ITEMS_PER_PRODUCER = 1000000;
+
+struct Event {
+    void* conn = nullptr;
+    size_t payload = 0;
+};
+
+template <typename Push, typename Pop>
+double run(size_t producers, Push push, Pop pop) {
+    std::atomic<bool> start{false};
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p] {
+            while (!start.load()) {}
+            for (size_t i = 0; i < ITEMS_PER_PRODUCER; ++i) {
+                push(Event{nullptr, i});
+            }
+        });
+    }
+
+    const auto tp_start = std::chrono::high_resolution_clock::now();
+    start.store(true);
+
+    const size_t total = producers * ITEMS_PER_PRODUCER;
+    size_t consumed = 0;
+    while (consumed < total) {
+        consumed += pop();
+    }
+
+    const auto tp_finish = std::chrono::high_resolution_clock::now();
+    for (auto&& thread : threads) {
+        thread.join();
+    }
+
+    const std::chrono::duration<double> elapsed = tp_finish - tp_start;
+    return total / elapsed.count();
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << std::setw(10) << "producers"
+        << std::setw(18) << "SafeQueue op/s"
+        << std::setw(18) << "RingQueue op/s"
+        << std::setw(22) << "RingQueue batch op/s" << std::endl;
+
+    for (size_t producers : {1, 2, 4, 8}) {
+        SafeQueue<Event> safe_queue;
+        const double safe = run(producers,
+            [&](Event&& ev) { safe_queue.push(std::move(ev)); },
+            [&]() -> size_t { Event ev; return safe_queue.pop(ev) ? 1 : 0; });
+
+        RingQueue<Event> ring_queue;
+        const double ring = run(producers,
+            [&](Event&& ev) { while (!ring_queue.try_push(std::move(ev))) { std::this_thread::yield(); } },
+            [&]() -> size_t { Event ev; return ring_queue.pop(ev) ? 1 : 0; });
+
+        RingQueue<Event> batch_queue;
+        const double batch = run(producers,
+            [&](Event&& ev) { while (!batch_queue.try_push(std::move(ev))) { std::this_thread::yield(); } },
+            [&]() -> size_t { Event evs[64]; return batch_queue.pop_batch(evs, 64); });
+
+        std::cout << std::setw(10) << producers
+            << std::setw(18) << std::fixed << std::setprecision(0) << safe
+            << std::setw(18) << ring
+            << std::setw(22) << batch << std::endl;
+    }
+    return 0;
+}
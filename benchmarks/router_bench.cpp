@@ -0,0 +1,73 @@
+#include <enji/router.h>
+#include <chrono>
+#include <iomanip>
+
+using enji::Router;
+using enji::RouteMatch;
+using enji::String;
+
+//
+// Dispatch cost per request for N routes `/api/res<i>/{id:int}`,
+// looking up the last declared one (worst case for a linear scan)
+//
+
+String route_name(size_t i) {
+    std::ostringstream buf;
+    buf << "/api/res" << i;
+    return buf.str();
+}
+
+template <typename Lookup>
+double ns_per_lookup(size_t iterations, Lookup lookup) {
+    const auto tp_start = std::chrono::high_resolution_clock::now();
+    size_t found = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        found += lookup() ? 1 : 0;
+    }
+    const auto tp_finish = std::chrono::high_resolution_clock::now();
+
+    if (found != iterations) {
+        std::cerr << "Lookup failed" << std::endl;
+        std::exit(1);
+    }
+
+    const std::chrono::duration<double, std::nano> elapsed = tp_finish - tp_start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << std::setw(8) << "routes"
+        << std::setw(20) << "regex scan ns/req"
+        << std::setw(20) << "router ns/req" << std::endl;
+
+    for (size_t routes : {10, 100, 1000}) {
+        std::vector<std::regex> regexes;
+        Router router;
+        for (size_t i = 0; i < routes; ++i) {
+            regexes.emplace_back("^" + route_name(i) + "/([0-9]+)$");
+            router.add("GET", route_name(i) + "/{id:int}", i);
+        }
+
+        const String path = route_name(routes - 1) + "/12345";
+
+        const double regex_ns = ns_per_lookup(200000 / routes, [&]() {
+            std::smatch groups;
+            for (auto&& regex : regexes) {
+                if (std::regex_search(path, groups, regex)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+
+        RouteMatch match;
+        const double router_ns = ns_per_lookup(1000000, [&]() {
+            return router.find("GET", path.data(), path.size(), match);
+        });
+
+        std::cout << std::setw(8) << routes
+            << std::setw(20) << std::fixed << std::setprecision(1) << regex_ns
+            << std::setw(20) << router_ns << std::endl;
+    }
+    return 0;
+}
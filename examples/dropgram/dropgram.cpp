@@ -62,9 +62,9 @@ void api_upload(const HttpRequest& req, HttpResponse& out) {
 
         const auto filename = filename_buf.str();
 
-        auto gram_file = std::ofstream{path_join(WEBCACHE_DIR, filename).c_str(), std::ios::binary};
-        gram_file.write(&file.body().front(), file.body().length());
-        gram_file.close();
+        if (!file.save_as(path_join(WEBCACHE_DIR, filename))) {
+            continue;
+        }
 
         sql << "INSERT INTO grams (filename, published) VALUES ('";
         sql << filename << "', " << "datetime('now'));";
@@ -109,11 +109,11 @@ int main(int argc, char* argv[]) {
     ServerConfig["worker_threads"] = 4;
     HttpServer server{ServerConfig};
     server.routes({
-        {"^/$", index},
-        {"^/static/(.+)$", serve_static(match1_filename)},
-        {"^/gram/(.+)$", serve_static(WEBCACHE_DIR, match1_filename)},
-        {"^/api/view", api_view},
-        {"^/api/upload", api_upload},
+        {"/", index},
+        {"/static/{path*}", serve_static(match1_filename)},
+        {"/gram/{path*}", serve_static(WEBCACHE_DIR, match1_filename)},
+        {"/api/view", api_view},
+        {"/api/upload", api_upload},
     });
     server.run();
     return 0;
@@ -5,22 +5,47 @@ using enji::HttpRequest;
 using enji::HttpResponse;
 using enji::ServerConfig;
 using enji::HttpServer;
+using enji::HttpRoute;
+using enji::HttpBodyStream;
 
 void upload_file(const HttpRequest& req, HttpResponse& out) {
     for (auto&& file : req.files()) {
         std::stringstream buf;
         buf << "Got filename: " << file.filename() << 
-            " with size " << file.body().size() << " bytes\n";
+            " with size " << file.size() << " bytes\n";
         out.body(std::move(buf));
     }
 }
 
+//
+// Streams the body through a checksum without keeping it in memory
+//
+void checksum(const HttpRequest& req, HttpBodyStream& body) {
+    auto sum = std::make_shared<uint32_t>(0);
+    auto size = std::make_shared<size_t>(0);
+
+    body.on_data([sum, size](const char* data, size_t length) {
+        for (size_t i = 0; i < length; ++i) {
+            *sum = *sum * 31 + static_cast<unsigned char>(data[i]);
+        }
+        *size += length;
+    });
+
+    body.on_complete([sum, size](const HttpRequest& req, HttpResponse& out) {
+        std::stringstream buf;
+        buf << "Got " << *size << " bytes, checksum " << *sum << "\n";
+        out.body(std::move(buf));
+    });
+}
+
 int main(int argc, char* argv[]) {
     ServerConfig["port"] = 3001;
     ServerConfig["worker_threads"] = 4;
+    ServerConfig["max_body_size"] = 1024 * 1024 * 1024;
     HttpServer server{ServerConfig};
     server.routes({
-        {"^/upload/(.+)$", upload_file},
+        {"POST", "/upload/{name*}", upload_file},
+        HttpRoute::streaming("POST", "/checksum", checksum),
     });
     server.run();
     return 0;
@@ -2,20 +2,18 @@
 
 using enji::Server;
 using enji::Connection;
-using enji::TransferBlock;
+using enji::BufferRef;
 using enji::ServerConfig;
 using enji::HttpServer;
 using enji::String;
 
 class PongConnection : public Connection {
 public:
-    PongConnection(Server* parent) : Connection{parent, 0} {}
+    PongConnection(Server* parent) : Connection{parent} {}
 
-    void handle_input(TransferBlock data) override {
-        std::cout << "Got " << String{data.data, data.data + data.size} << std::endl;
-        auto mem = TransferBlock{new char[data.size], data.size};
-        std::memcpy((void*)mem.data, data.data, data.size);
-        write_chunk(mem);
+    void handle_input(const BufferRef& data) override {
+        std::cout << "Got " << String{data.data(), data.data() + data.size()} << std::endl;
+        write_chunk(data.share());
     }
 };
 
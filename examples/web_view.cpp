@@ -13,7 +13,7 @@ int main(int argc, char* argv[]) {
     ServerConfig["worker_threads"] = 4;
     HttpServer server{ServerConfig};
     server.routes({
-        {"^/(.+)$", enji::serve_static(".", enji::match1_filename)},
+        {"/{path*}", enji::serve_static(".", enji::match1_filename)},
     });
     server.run();
     return 0;
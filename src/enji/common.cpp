@@ -1,4 +1,17 @@
 #include "common.h"
+#include <fcntl.h>
+#include <cstring>
+#include <new>
+#include <algorithm>
+#include <stdexcept>
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+#include <cstdlib>
+
+#ifdef _WIN32
+#   include <malloc.h>
+#endif
 
 namespace enji {
 
@@ -12,25 +25,498 @@ void Thread::run(Func&& thread_func) {
     uv_thread_create(&thread_, run_thread, this);
 }
 
-TransferBlock::TransferBlock()
-:   data{nullptr},
-    size{0} {
+const size_t StringView::npos;
+
+StringView StringView::substr(size_t pos, size_t count) const {
+    if (pos > size_) {
+        throw std::out_of_range("StringView::substr");
+    }
+    return StringView{data_ + pos, std::min(count, size_ - pos)};
+}
+
+size_t StringView::find(StringView str, size_t pos) const {
+    if (pos > size_ || str.size() > size_ - pos) {
+        return npos;
+    }
+    const char* found = std::search(data_ + pos, data_ + size_, str.begin(), str.end());
+    return found == data_ + size_ && !str.empty() ? npos : found - data_;
+}
+
+size_t StringView::find(char c, size_t pos) const {
+    if (pos >= size_) {
+        return npos;
+    }
+    const void* found = std::memchr(data_ + pos, c, size_ - pos);
+    return found ? static_cast<const char*>(found) - data_ : npos;
+}
+
+size_t StringView::find_first_of(StringView chars, size_t pos) const {
+    for (size_t i = pos; i < size_; ++i) {
+        if (chars.find(data_[i]) != npos) {
+            return i;
+        }
+    }
+    return npos;
+}
+
+size_t StringView::rfind(char c) const {
+    for (size_t i = size_; i > 0; --i) {
+        if (data_[i - 1] == c) {
+            return i - 1;
+        }
+    }
+    return npos;
+}
+
+int StringView::compare(StringView other) const {
+    const size_t common = std::min(size_, other.size_);
+    const int result = common ? std::memcmp(data_, other.data_, common) : 0;
+    if (result != 0) {
+        return result;
+    }
+    return size_ < other.size_ ? -1 : (size_ > other.size_ ? 1 : 0);
+}
+
+std::ostream& operator << (std::ostream& out, StringView str) {
+    return out.write(str.data(), str.size());
 }
 
-TransferBlock::TransferBlock(const char* data, size_t size)
-:   data{data},
-    size{size} {
+bool equal_nocase(StringView a, StringView b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void TransferBlock::free() {
-    if (data) {
-        deleter(const_cast<char*>(data));
+const size_t CacheAligned::ALIGNMENT;
+
+void* CacheAligned::operator new(size_t size) {
+#ifdef _WIN32
+    void* ptr = _aligned_malloc(size, ALIGNMENT);
+#else
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, ALIGNMENT, size) != 0) {
+        ptr = nullptr;
+    }
+#endif
+    if (!ptr) {
+        throw std::bad_alloc{};
     }
+    return ptr;
+}
+
+void CacheAligned::operator delete(void* ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
+static_assert(sizeof(BufferStorage) <= BufferStorage::HEADER_SIZE, "BufferStorage doesn't fit its header");
+
+BufferStorage* BufferStorage::init(void* memory, Release release, void* context) {
+    return new (memory) BufferStorage{release, context};
+}
+
+namespace {
+
+struct StringStorage : BufferStorage {
+    StringStorage(String&& str)
+    :   BufferStorage{[](BufferStorage* storage) { delete static_cast<StringStorage*>(storage); }, nullptr},
+        str{std::move(str)} {}
+
+    String str;
+};
+
+void release_heap_storage(BufferStorage* storage) {
+    storage->~BufferStorage();
+    delete[] reinterpret_cast<char*>(storage);
+}
+
+} // namespace
+
+BufferRef::BufferRef(BufferRef&& other)
+:   storage_{other.storage_},
+    data_{other.data_},
+    size_{other.size_} {
+    other.storage_ = nullptr;
+    other.data_ = nullptr;
+    other.size_ = 0;
 }
 
-void TransferBlock::to_uv_buf(uv_buf_t* cpy) {
-    cpy->base = (char*) data;
-    cpy->len = size_t(size);
+BufferRef& BufferRef::operator = (BufferRef&& other) {
+    if (this != &other) {
+        reset();
+        std::swap(storage_, other.storage_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+    }
+    return *this;
+}
+
+BufferRef BufferRef::allocate(size_t size) {
+    char* memory = new char[BufferStorage::HEADER_SIZE + size];
+    auto storage = BufferStorage::init(memory, release_heap_storage, nullptr);
+    return adopt(storage, memory + BufferStorage::HEADER_SIZE, size);
+}
+
+BufferRef BufferRef::copy(const char* data, size_t size) {
+    BufferRef buf = allocate(size);
+    if (size) {
+        std::memcpy(buf.mutable_data(), data, size);
+    }
+    return buf;
+}
+
+BufferRef BufferRef::from_string(String&& str) {
+    auto storage = new StringStorage{std::move(str)};
+    return adopt(storage, storage->str.data(), storage->str.size());
+}
+
+BufferRef BufferRef::view(const char* data, size_t size) {
+    return adopt(nullptr, data, size);
+}
+
+BufferRef BufferRef::adopt(BufferStorage* storage, const char* data, size_t size) {
+    BufferRef buf;
+    buf.storage_ = storage;
+    buf.data_ = data;
+    buf.size_ = size;
+    return buf;
+}
+
+BufferRef BufferRef::share() const {
+    return slice(0, size_);
+}
+
+BufferRef BufferRef::slice(size_t offset, size_t size) const {
+    if (offset > size_ || size > size_ - offset) {
+        throw std::out_of_range("BufferRef slice is out of range");
+    }
+    if (storage_) {
+        storage_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return adopt(storage_, data_ + offset, size);
+}
+
+void BufferRef::truncate(size_t size) {
+    if (size < size_) {
+        size_ = size;
+    }
+}
+
+void BufferRef::reset() {
+    if (storage_ && storage_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        storage_->release(storage_);
+    }
+    storage_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+void BufferRef::to_uv_buf(uv_buf_t* cpy) const {
+    cpy->base = const_cast<char*>(data_);
+    cpy->len = size_;
+}
+
+void BufferChain::append(BufferRef&& buf) {
+    if (buf.empty()) {
+        return;
+    }
+    bytes_ += buf.size();
+    bufs_.emplace_back(std::move(buf));
+}
+
+void BufferChain::append(BufferChain&& chain) {
+    for (auto&& buf : chain.bufs_) {
+        append(std::move(buf));
+    }
+    chain.clear();
+}
+
+void BufferChain::clear() {
+    bufs_.clear();
+    bytes_ = 0;
+}
+
+namespace {
+
+const char* const WEEKDAYS[] = {"Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"};
+const char* const MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+//
+// Proleptic Gregorian calendar without gmtime/timegm, which differ
+// between platforms in name and thread safety
+//
+int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+void civil_from_days(int64_t z, int64_t& y, unsigned& m, unsigned& d) {
+    z += 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const unsigned doe = static_cast<unsigned>(z - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+}
+
+bool parse_digits(StringView str, size_t pos, size_t count, unsigned& value) {
+    value = 0;
+    for (size_t i = pos; i < pos + count; ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return false;
+        }
+        value = value * 10 + unsigned(str[i] - '0');
+    }
+    return true;
+}
+
+} // namespace
+
+String format_http_date(int64_t seconds) {
+    const int64_t days = (seconds >= 0 ? seconds : seconds - 86399) / 86400;
+    const int64_t rest = seconds - days * 86400;
+
+    int64_t year;
+    unsigned month, day;
+    civil_from_days(days, year, month, day);
+
+    char buf[32];
+    const int size = std::snprintf(buf, sizeof(buf), "%s, %02u %s %04lld %02d:%02d:%02d GMT",
+        WEEKDAYS[((days % 7) + 7) % 7], day, MONTHS[month - 1], static_cast<long long>(year),
+        int(rest / 3600), int(rest / 60 % 60), int(rest % 60));
+    return String{buf, size_t(size)};
+}
+
+bool parse_http_date(StringView date, int64_t& seconds) {
+    // "Sun, 06 Nov 1994 08:49:37 GMT"
+    if (date.size() != 29 || date[3] != ',' || date[4] != ' ' || date[7] != ' ' || date[11] != ' '
+            || date[16] != ' ' || date[19] != ':' || date[22] != ':' || date.substr(25) != StringView{" GMT"}) {
+        return false;
+    }
+
+    unsigned month = 0;
+    while (month < 12 && date.substr(8, 3) != StringView{MONTHS[month]}) {
+        ++month;
+    }
+
+    unsigned day, year, hour, minute, second;
+    if (month == 12 || !parse_digits(date, 5, 2, day) || !parse_digits(date, 12, 4, year)
+            || !parse_digits(date, 17, 2, hour) || !parse_digits(date, 20, 2, minute)
+            || !parse_digits(date, 23, 2, second)) {
+        return false;
+    }
+    if (day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return false;
+    }
+
+    seconds = days_from_civil(year, month + 1, day) * 86400 + hour * 3600 + minute * 60 + second;
+    return true;
+}
+
+namespace {
+
+// Seconds since the epoch, 0 until a loop timer runs
+std::atomic<int64_t> http_clock{0};
+
+} // namespace
+
+StringView cached_http_date() {
+    thread_local int64_t formatted_at = -1;
+    thread_local char date[32];
+    thread_local size_t date_size = 0;
+
+    int64_t now = http_clock.load(std::memory_order_relaxed);
+    if (now == 0) {
+        now = int64_t(std::time(nullptr));
+    }
+    if (now != formatted_at) {
+        const String formatted = format_http_date(now);
+        date_size = std::min(formatted.size(), sizeof(date));
+        std::memcpy(date, formatted.data(), date_size);
+        formatted_at = now;
+    }
+    return StringView{date, date_size};
+}
+
+void update_http_clock() {
+    http_clock.store(int64_t(std::time(nullptr)), std::memory_order_relaxed);
+}
+
+FileHandle::~FileHandle() {
+    if (fd_ >= 0) {
+        uv_fs_t close_req;
+        uv_fs_close(nullptr, &close_req, fd_, nullptr);
+        uv_fs_req_cleanup(&close_req);
+    }
+}
+
+std::shared_ptr<FileHandle> FileHandle::open(const String& path) {
+    uv_fs_t open_req;
+    uv_fs_open(nullptr, &open_req, path.c_str(), O_RDONLY, 0, nullptr);
+    const auto fd = static_cast<uv_file>(open_req.result);
+    uv_fs_req_cleanup(&open_req);
+    if (fd < 0) {
+        return nullptr;
+    }
+    return std::make_shared<FileHandle>(fd);
+}
+
+BufferPool::BufferPool(size_t block_size, size_t max_free_blocks)
+:   block_size_{block_size < sizeof(FreeBlock) ? sizeof(FreeBlock) : block_size},
+    max_free_blocks_{max_free_blocks} {
+    free_blocks_.reserve(max_free_blocks_);
+}
+
+BufferPool::~BufferPool() {
+    reclaim_returned();
+    for (auto block : free_blocks_) {
+        delete[] block;
+    }
+}
+
+char* BufferPool::acquire() {
+    if (free_blocks_.empty()) {
+        reclaim_returned();
+    }
+
+    if (free_blocks_.empty()) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return new char[block_size_];
+    }
+
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    char* block = free_blocks_.back();
+    free_blocks_.pop_back();
+    return block;
+}
+
+void BufferPool::release_local(char* block) {
+    if (free_blocks_.size() < max_free_blocks_) {
+        free_blocks_.push_back(block);
+    } else {
+        delete[] block;
+    }
+}
+
+void BufferPool::release(char* block) {
+    auto node = reinterpret_cast<FreeBlock*>(block);
+    node->next = returned_.load(std::memory_order_relaxed);
+    while (!returned_.compare_exchange_weak(node->next, node,
+        std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    returned_count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BufferPool::reclaim_returned() {
+    FreeBlock* node = returned_.exchange(nullptr, std::memory_order_acquire);
+    while (node) {
+        FreeBlock* next = node->next;
+        release_local(reinterpret_cast<char*>(node));
+        node = next;
+    }
+}
+
+BufferPool::Stats BufferPool::stats() const {
+    Stats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.returned = returned_count_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+const size_t Arena::DEFAULT_BLOCK_SIZE;
+
+Arena::Arena(size_t block_size)
+:   block_size_{block_size} {
+}
+
+char* Arena::allocate(size_t size) {
+    if (blocks_.empty() || blocks_.back().size - offset_ < size) {
+        const size_t block_size = std::max(block_size_, size);
+        blocks_.push_back(Block{std::unique_ptr<char[]>{new char[block_size]}, block_size});
+        offset_ = 0;
+    }
+
+    char* memory = blocks_.back().memory.get() + offset_;
+    offset_ += size;
+    used_ += size;
+    return memory;
+}
+
+StringView Arena::copy(const char* data, size_t size) {
+    char* memory = allocate(size);
+    if (size) {
+        std::memcpy(memory, data, size);
+    }
+    return StringView{memory, size};
+}
+
+StringView Arena::append(StringView head, const char* data, size_t size) {
+    if (!blocks_.empty()) {
+        Block& last = blocks_.back();
+        const bool is_last = head.end() == last.memory.get() + offset_
+            && head.data() >= last.memory.get();
+        if (is_last && last.size - offset_ >= size) {
+            std::memcpy(last.memory.get() + offset_, data, size);
+            offset_ += size;
+            used_ += size;
+            return StringView{head.data(), head.size() + size};
+        }
+    }
+
+    //
+    // Value that keeps growing, like a body coming in read by read: move
+    // it to a block twice its size, so copies stay linear overall, and
+    // free the block it leaves when nothing else lives there
+    //
+    const size_t total = head.size() + size;
+    if (!blocks_.empty() && total > block_size_) {
+        Block& last = blocks_.back();
+        const bool alone = head.data() == last.memory.get() && head.end() == last.memory.get() + offset_;
+        Block grown{std::unique_ptr<char[]>{new char[total * 2]}, total * 2};
+        std::memcpy(grown.memory.get(), head.data(), head.size());
+        std::memcpy(grown.memory.get() + head.size(), data, size);
+        if (alone) {
+            last = std::move(grown);
+            used_ += size;
+        } else {
+            blocks_.push_back(std::move(grown));
+            used_ += total;
+        }
+        offset_ = total;
+        return StringView{blocks_.back().memory.get(), total};
+    }
+
+    char* memory = allocate(total);
+    if (!head.empty()) {
+        std::memcpy(memory, head.data(), head.size());
+    }
+    std::memcpy(memory + head.size(), data, size);
+    return StringView{memory, total};
+}
+
+void Arena::reset() {
+    if (blocks_.size() > 1 || (!blocks_.empty() && blocks_.front().size > block_size_)) {
+        blocks_.clear();
+    }
+    offset_ = 0;
+    used_ = 0;
 }
 
 bool is_slash(const char c) {
@@ -7,10 +7,11 @@
 #include <map>
 #include <queue>
 #include <thread>
-
-#ifdef _MSC_VER
-#   include <mutex>
-#endif
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <cstdint>
 
 #include <uv.h>
 
@@ -20,6 +21,78 @@ class Connection;
 
 typedef std::string String;
 
+//
+// Non-owning view of characters, like C++17 std::string_view. Whoever
+// hands one out keeps the bytes alive (pinned buffer, arena, literal).
+//
+class StringView {
+public:
+    static const size_t npos = size_t(-1);
+
+    StringView() {}
+
+    StringView(const char* data, size_t size)
+    :   data_{data},
+        size_{size} {}
+
+    StringView(const char* str)
+    :   data_{str},
+        size_{std::char_traits<char>::length(str)} {}
+
+    StringView(const String& str)
+    :   data_{str.data()},
+        size_{str.size()} {}
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+
+    char operator [] (size_t pos) const { return data_[pos]; }
+
+    StringView substr(size_t pos, size_t count = npos) const;
+
+    size_t find(StringView str, size_t pos = 0) const;
+    size_t find(char c, size_t pos = 0) const;
+    size_t find_first_of(StringView chars, size_t pos = 0) const;
+    size_t rfind(char c) const;
+
+    int compare(StringView other) const;
+
+    String str() const { return String{data_, size_}; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+inline bool operator == (StringView a, StringView b) { return a.compare(b) == 0; }
+inline bool operator != (StringView a, StringView b) { return a.compare(b) != 0; }
+inline bool operator < (StringView a, StringView b) { return a.compare(b) < 0; }
+
+std::ostream& operator << (std::ostream& out, StringView str);
+
+// ASCII case-insensitive comparison, for protocol tokens
+bool equal_nocase(StringView a, StringView b);
+
+// IMF-fixdate of RFC 7231, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+String format_http_date(int64_t seconds);
+
+// Only the IMF-fixdate form, false for anything else
+bool parse_http_date(StringView date, int64_t& seconds);
+
+//
+// IMF-fixdate of the current second for the Date header. Reformatted
+// only when the clock moves, once per thread; event loops advance the
+// clock with a timer
+//
+StringView cached_http_date();
+
+// Event loop timer, once a second
+void update_http_clock();
+
 class Defer {
 public:
     typedef std::function<void (void)> Deleter;
@@ -106,7 +179,7 @@ class SafeQueue {
 public:
     void push(T&& value) {
         std::lock_guard<std::mutex> guard{mutex_};
-        queue_.emplace(value);
+        queue_.emplace(std::move(value));
     }
 
     bool pop(T& obj) {
@@ -128,6 +201,153 @@ private:
     mutable std::mutex mutex_;
 };
 
+//
+// Base for heap objects that embed a RingQueue. C++14 `new` ignores
+// alignment beyond max_align_t, so the queue positions would share cache
+// lines with whatever the allocator puts next to the object
+//
+struct CacheAligned {
+    static const size_t ALIGNMENT = 64;
+
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+};
+
+//
+// Bounded lock-free ring buffer (Vyukov's sequence-numbered cells).
+// Safe for any number of producers and consumers, so it serves both as
+// MPSC (workers -> loop) and SPMC (loop -> workers). Capacity is rounded
+// up to a power of two.
+//
+template<typename T>
+class RingQueue {
+public:
+    explicit RingQueue(size_t capacity = 16384)
+    :   mask_{round_capacity(capacity) - 1},
+        cells_{new Cell[mask_ + 1]} {
+        for (size_t i = 0; i <= mask_; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    RingQueue(const RingQueue&) = delete;
+    RingQueue& operator = (const RingQueue&) = delete;
+
+    bool try_push(T&& value) {
+        return push_batch(&value, 1) == 1;
+    }
+
+    bool pop(T& value) {
+        return pop_batch(&value, 1) == 1;
+    }
+
+    //
+    // Moves up to `count` values into the queue with one position claim.
+    // Returns how many were pushed; the rest are left untouched.
+    //
+    size_t push_batch(T* values, size_t count) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        size_t claimed;
+        while (true) {
+            claimed = 0;
+            while (claimed < count && claimed <= mask_) {
+                const size_t seq = cells_[(pos + claimed) & mask_].sequence.load(std::memory_order_acquire);
+                if (seq != pos + claimed) {
+                    break;
+                }
+                ++claimed;
+            }
+
+            if (claimed == 0) {
+                const size_t seq = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+                if (intptr_t(seq) - intptr_t(pos) < 0) {
+                    return 0;
+                }
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < claimed; ++i) {
+            Cell& cell = cells_[(pos + i) & mask_];
+            cell.value = std::move(values[i]);
+            cell.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return claimed;
+    }
+
+    //
+    // Moves up to `max_count` values out of the queue with one position claim.
+    //
+    size_t pop_batch(T* values, size_t max_count) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        size_t claimed;
+        while (true) {
+            claimed = 0;
+            while (claimed < max_count && claimed <= mask_) {
+                const size_t seq = cells_[(pos + claimed) & mask_].sequence.load(std::memory_order_acquire);
+                if (seq != pos + claimed + 1) {
+                    break;
+                }
+                ++claimed;
+            }
+
+            if (claimed == 0) {
+                const size_t seq = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+                if (intptr_t(seq) - intptr_t(pos + 1) < 0) {
+                    return 0;
+                }
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (dequeue_pos_.compare_exchange_weak(pos, pos + claimed, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < claimed; ++i) {
+            Cell& cell = cells_[(pos + i) & mask_];
+            values[i] = std::move(cell.value);
+            cell.sequence.store(pos + i + mask_ + 1, std::memory_order_release);
+        }
+        return claimed;
+    }
+
+    bool empty() const {
+        const size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        return cells_[pos & mask_].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    static size_t round_capacity(size_t capacity) {
+        size_t rounded = 2;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        return rounded;
+    }
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static const size_t CACHE_LINE = 64;
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+
+    alignas(CACHE_LINE) std::atomic<size_t> enqueue_pos_{0};
+    alignas(CACHE_LINE) std::atomic<size_t> dequeue_pos_{0};
+};
+
 class IInputStream {
 public:
     virtual size_t read(char* data, size_t bytes) = 0;
@@ -148,23 +368,226 @@ public:
     virtual ~IOutputStream() { }
 };
 
+//
+// Reference counted header in front of (or next to) shared bytes. The
+// last BufferRef to let go calls `release`, which frees the memory or
+// hands it back to whoever owns it.
+//
+struct BufferStorage {
+    typedef void (*Release)(BufferStorage*);
+
+    // Room reserved in front of data when the header shares a block with it
+    static const size_t HEADER_SIZE = 32;
+
+    BufferStorage(Release release, void* context)
+    :   release{release},
+        context{context} {}
+
+    static BufferStorage* init(void* memory, Release release, void* context);
+
+    std::atomic<size_t> refs{1};
+    Release release;
+    void* context;
+};
+
+//
+// Move-only reference to a slice of shared bytes. share() and slice()
+// take another reference explicitly; views of static data have no
+// storage and are never freed.
+//
+class BufferRef {
+public:
+    BufferRef() {}
+    ~BufferRef() { reset(); }
+
+    BufferRef(BufferRef&& other);
+    BufferRef& operator = (BufferRef&& other);
+
+    BufferRef(const BufferRef&) = delete;
+    BufferRef& operator = (const BufferRef&) = delete;
+
+    static BufferRef allocate(size_t size);
+    static BufferRef copy(const char* data, size_t size);
+    static BufferRef from_string(String&& str);
+    static BufferRef view(const char* data, size_t size);
+    static BufferRef adopt(BufferStorage* storage, const char* data, size_t size);
+
+    BufferRef share() const;
+    BufferRef slice(size_t offset, size_t size) const;
+
+    const char* data() const { return data_; }
+    char* mutable_data() { return const_cast<char*>(data_); }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    void truncate(size_t size);
+    void reset();
+
+    void to_uv_buf(uv_buf_t* cpy) const;
+
+private:
+    BufferStorage* storage_ = nullptr;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+//
+// Ordered list of slices written or read as one piece
+//
+class BufferChain {
+public:
+    void append(BufferRef&& buf);
+    void append(BufferChain&& chain);
+
+    size_t size() const { return bytes_; }
+    bool empty() const { return bufs_.empty(); }
+    size_t count() const { return bufs_.size(); }
+
+    std::vector<BufferRef>& bufs() { return bufs_; }
+    const std::vector<BufferRef>& bufs() const { return bufs_; }
+
+    void clear();
+
+private:
+    std::vector<BufferRef> bufs_;
+    size_t bytes_ = 0;
+};
+
+//
+// Open file descriptor, closed when the last reference goes away
+//
+class FileHandle {
+public:
+    explicit FileHandle(uv_file fd) : fd_(fd) {}
+    ~FileHandle();
+
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator = (const FileHandle&) = delete;
+
+    uv_file fd() const { return fd_; }
+
+    // Read-only handle, nullptr when the file can't be opened
+    static std::shared_ptr<FileHandle> open(const String& path);
+
+private:
+    uv_file fd_;
+};
+
+//
+// Byte range of an open file, sent to a socket without copying it
+// through user space where the platform allows
+//
+struct FileRange {
+    std::shared_ptr<FileHandle> file;
+    int64_t offset = 0;
+    size_t length = 0;
+};
+
+//
+// Piece of output: bytes in memory or a file range
+//
+struct OutputSegment {
+    BufferRef buf;
+    FileRange file;
+
+    bool is_file() const { return bool(file.file); }
+    size_t size() const { return is_file() ? file.length : buf.size(); }
+};
+
 struct WriteContext {
     uv_write_t req;
-    uv_buf_t buf;
+    std::vector<uv_buf_t> bufs;
+    BufferChain data;
+    size_t bytes = 0;
     Connection* conn;
-    bool close = false;
 };
 
-struct TransferBlock {
-    const char* data = nullptr;
-    size_t size = 0;
-    std::function<void (char*)> deleter = [] (char* ptr) { delete[] ptr; };
+//
+// Slab of fixed-size blocks owned by one thread (event loop). The owner
+// acquires and releases blocks without synchronization, other threads
+// give blocks back through a lock-free return stack that the owner
+// reclaims when its own free list runs dry.
+//
+class BufferPool {
+public:
+    struct Stats {
+        size_t hits;
+        size_t misses;
+        size_t returned;
+    };
+
+    BufferPool(size_t block_size, size_t max_free_blocks);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator = (const BufferPool&) = delete;
+
+    size_t block_size() const { return block_size_; }
+
+    // Owner thread only
+    char* acquire();
+    void release_local(char* block);
+
+    // Any thread
+    void release(char* block);
+
+    Stats stats() const;
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    void reclaim_returned();
+
+    const size_t block_size_;
+    const size_t max_free_blocks_;
+
+    std::vector<char*> free_blocks_;
+
+    std::atomic<FreeBlock*> returned_{nullptr};
+
+    std::atomic<size_t> hits_{0};
+    std::atomic<size_t> misses_{0};
+    std::atomic<size_t> returned_count_{0};
+};
+
+//
+// Bump allocator for per-request data. Everything is released at once by
+// reset(), which keeps the first block for the next request.
+//
+class Arena {
+public:
+    static const size_t DEFAULT_BLOCK_SIZE = 4096;
+
+    Arena(size_t block_size = DEFAULT_BLOCK_SIZE);
 
-    TransferBlock();
-    TransferBlock(const char* data, size_t size);
-    void free();
+    Arena(const Arena&) = delete;
+    Arena& operator = (const Arena&) = delete;
+
+    char* allocate(size_t size);
+
+    StringView copy(const char* data, size_t size);
+
+    // `head` + [data, data + size). Grows in place when `head` is the
+    // last allocation, otherwise copies both
+    StringView append(StringView head, const char* data, size_t size);
+
+    void reset();
+
+    // Bytes handed out since the last reset
+    size_t used() const { return used_; }
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> memory;
+        size_t size;
+    };
 
-    void to_uv_buf(uv_buf_t* cpy);
+    std::vector<Block> blocks_;
+    size_t block_size_;
+    size_t offset_ = 0;
+    size_t used_ = 0;
 };
 
 template <typename Exc>
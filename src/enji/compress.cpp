@@ -0,0 +1,137 @@
+#include "compress.h"
+#include <zlib.h>
+
+namespace enji {
+
+namespace {
+
+StringView trim(StringView str) {
+    size_t begin = 0;
+    size_t end = str.size();
+    while (begin < end && (str[begin] == ' ' || str[begin] == '\t')) {
+        ++begin;
+    }
+    while (end > begin && (str[end - 1] == ' ' || str[end - 1] == '\t')) {
+        --end;
+    }
+    return str.substr(begin, end - begin);
+}
+
+bool starts_with(StringView str, StringView prefix) {
+    return str.size() >= prefix.size() && str.substr(0, prefix.size()) == prefix;
+}
+
+// Weight of `q=...` among the coding parameters, 1 when absent
+bool zero_weight(StringView params) {
+    size_t pos = 0;
+    while (pos < params.size()) {
+        size_t end = params.find(';', pos);
+        if (end == StringView::npos) {
+            end = params.size();
+        }
+        const StringView param = trim(params.substr(pos, end - pos));
+        if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+            const StringView value = param.substr(2);
+            for (size_t i = 0; i < value.size(); ++i) {
+                if (value[i] != '0' && value[i] != '.') {
+                    return false;
+                }
+            }
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+} // namespace
+
+GzipEncoder::GzipEncoder(int level)
+:   stream_{new z_stream{}} {
+    // 16 + MAX_WBITS asks zlib for the gzip wrapper
+    ok_ = deflateInit2(stream_.get(), level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+GzipEncoder::~GzipEncoder() {
+    deflateEnd(stream_.get());
+}
+
+bool GzipEncoder::deflate(const char* data, size_t size, int flush) {
+    if (!ok_) {
+        return false;
+    }
+
+    stream_->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream_->avail_in = static_cast<uInt>(size);
+
+    int result;
+    do {
+        const size_t used = out_.size();
+        const size_t room = deflateBound(stream_.get(), stream_->avail_in) + 64;
+        out_.resize(used + room);
+        stream_->next_out = reinterpret_cast<Bytef*>(&out_[used]);
+        stream_->avail_out = static_cast<uInt>(room);
+
+        result = ::deflate(stream_.get(), flush);
+        out_.resize(used + room - stream_->avail_out);
+        if (result == Z_STREAM_ERROR) {
+            ok_ = false;
+            return false;
+        }
+    } while (stream_->avail_in > 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+
+    return true;
+}
+
+bool GzipEncoder::write(const char* data, size_t size) {
+    return deflate(data, size, Z_NO_FLUSH);
+}
+
+bool GzipEncoder::finish() {
+    return deflate(nullptr, 0, Z_FINISH);
+}
+
+bool gzip(const char* data, size_t size, int level, String& out) {
+    GzipEncoder encoder{level};
+    if (!encoder.write(data, size) || !encoder.finish()) {
+        return false;
+    }
+    out = std::move(encoder.result());
+    return true;
+}
+
+bool accepts_encoding(StringView accept_encoding, StringView coding) {
+    bool any = false;
+    size_t pos = 0;
+    while (pos < accept_encoding.size()) {
+        size_t end = accept_encoding.find(',', pos);
+        if (end == StringView::npos) {
+            end = accept_encoding.size();
+        }
+
+        const StringView item = accept_encoding.substr(pos, end - pos);
+        const size_t semicolon = item.find(';');
+        const StringView name = trim(item.substr(0, semicolon == StringView::npos ? item.size() : semicolon));
+        const bool refused = semicolon != StringView::npos && zero_weight(item.substr(semicolon + 1));
+
+        if (equal_nocase(name, coding)) {
+            return !refused;
+        }
+        if (name == StringView{"*"}) {
+            any = !refused;
+        }
+        pos = end + 1;
+    }
+    return any;
+}
+
+bool compressible_type(StringView content_type) {
+    return starts_with(content_type, "text/")
+        || starts_with(content_type, "application/javascript")
+        || starts_with(content_type, "application/json")
+        || starts_with(content_type, "application/xml")
+        || starts_with(content_type, "image/svg+xml")
+        || starts_with(content_type, "application/wasm");
+}
+
+} // namespace enji
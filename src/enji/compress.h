@@ -0,0 +1,47 @@
+#pragma once
+
+#include "common.h"
+
+typedef struct z_stream_s z_stream;
+
+namespace enji {
+
+//
+// Streaming gzip (RFC 1952) encoder for Content-Encoding: gzip
+//
+class GzipEncoder {
+public:
+    // zlib level 1-9
+    explicit GzipEncoder(int level = 6);
+    ~GzipEncoder();
+
+    GzipEncoder(const GzipEncoder&) = delete;
+    GzipEncoder& operator = (const GzipEncoder&) = delete;
+
+    bool write(const char* data, size_t size);
+
+    // Flushes the trailer, result() is complete after it
+    bool finish();
+
+    String& result() { return out_; }
+
+private:
+    bool deflate(const char* data, size_t size, int flush);
+
+    std::unique_ptr<z_stream> stream_;
+    bool ok_;
+    String out_;
+};
+
+bool gzip(const char* data, size_t size, int level, String& out);
+
+//
+// Whether an Accept-Encoding value allows `coding`, honoring q=0
+// and `*`
+//
+bool accepts_encoding(StringView accept_encoding, StringView coding);
+
+// Text-like types worth compressing
+bool compressible_type(StringView content_type);
+
+} // namespace enji
@@ -0,0 +1,357 @@
+#include "file_cache.h"
+#include <cstdio>
+#include "compress.h"
+
+#ifndef _WIN32
+#   include <sys/mman.h>
+#endif
+
+namespace enji {
+
+namespace {
+
+const std::pair<const char*, const char*> MIME_TYPES[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "application/javascript; charset=utf-8"},
+    {"mjs", "application/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/x-icon"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"pdf", "application/pdf"},
+    {"wasm", "application/wasm"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"mp3", "audio/mpeg"},
+};
+
+bool is_regular(const uv_stat_t& st) {
+    return (st.st_mode & S_IFMT) == S_IFREG;
+}
+
+bool same_version(const CachedFile& file, const uv_stat_t& st) {
+    return file.size == st.st_size
+        && file.mtime_sec == st.st_mtim.tv_sec
+        && file.mtime_nsec == st.st_mtim.tv_nsec;
+}
+
+#ifndef _WIN32
+//
+// Unmapped when the last BufferRef into the mapping goes away
+//
+struct MappedStorage : BufferStorage {
+    MappedStorage(void* addr, size_t size)
+    :   BufferStorage{[](BufferStorage* storage) { delete static_cast<MappedStorage*>(storage); }, nullptr},
+        addr{addr},
+        size{size} {}
+
+    ~MappedStorage() {
+        munmap(addr, size);
+    }
+
+    void* addr;
+    size_t size;
+};
+#endif
+
+// Empty when the file can't be mapped, the caller falls back to sendfile
+BufferRef map_file(uv_file fd, size_t size) {
+#ifndef _WIN32
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return BufferRef{};
+    }
+
+    // Responses mostly walk the file front to back, let readahead run
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    auto storage = new MappedStorage{addr, size};
+    return BufferRef::adopt(storage, static_cast<const char*>(addr), size);
+#else
+    return BufferRef{};
+#endif
+}
+
+std::shared_ptr<CachedFile> read_file(const String& path, size_t max_file_size, size_t max_mapped_file_size) {
+    auto handle = FileHandle::open(path);
+    if (!handle) {
+        return nullptr;
+    }
+
+    uv_fs_t stat_req;
+    const int stat_result = uv_fs_fstat(nullptr, &stat_req, handle->fd(), nullptr);
+    auto stat_req_exit = Defer{[&stat_req] { uv_fs_req_cleanup(&stat_req); }};
+    if (stat_result != 0 || !is_regular(stat_req.statbuf)) {
+        return nullptr;
+    }
+    const uv_stat_t& st = stat_req.statbuf;
+
+    auto file = std::make_shared<CachedFile>();
+    file->path = path;
+    file->size = st.st_size;
+    file->mtime_sec = st.st_mtim.tv_sec;
+    file->mtime_nsec = st.st_mtim.tv_nsec;
+    file->last_modified = format_http_date(file->mtime_sec);
+
+    char etag[64];
+    const int etag_size = std::snprintf(etag, sizeof(etag), "\"%llx-%lx-%llx\"",
+        static_cast<unsigned long long>(file->mtime_sec), file->mtime_nsec,
+        static_cast<unsigned long long>(file->size));
+    file->etag.assign(etag, size_t(etag_size));
+
+    if (file->size > max_file_size) {
+        if (file->size <= max_mapped_file_size) {
+            file->body = map_file(handle->fd(), size_t(file->size));
+            file->has_body = file->mapped = !file->body.empty();
+        }
+        return file;
+    }
+
+    BufferRef body = file->size ? BufferRef::allocate(size_t(file->size)) : BufferRef{};
+    size_t offset = 0;
+    while (offset < file->size) {
+        uv_buf_t buf = uv_buf_init(body.mutable_data() + offset, static_cast<unsigned int>(file->size - offset));
+        uv_fs_t read_req;
+        const int read = uv_fs_read(nullptr, &read_req, handle->fd(), &buf, 1, int64_t(offset), nullptr);
+        uv_fs_req_cleanup(&read_req);
+        if (read <= 0) {
+            // Truncated while reading, send it from disk this time
+            return file;
+        }
+        offset += size_t(read);
+    }
+
+    file->body = std::move(body);
+    file->has_body = true;
+    return file;
+}
+
+//
+// `foo.css.gz` next to `foo.css`. One older than the file is a leftover
+// of a previous version and is skipped
+//
+std::shared_ptr<const CachedFile> load_sibling(const CachedFile& file, const char* suffix, StringView encoding,
+        const FileCacheOptions& options) {
+    auto sibling = file.has_body
+        ? read_file(file.path + suffix, options.max_file_size, options.max_mapped_file_size)
+        : read_file(file.path + suffix, 0, 0);
+    if (!sibling || sibling->mtime_sec < file.mtime_sec) {
+        return nullptr;
+    }
+    sibling->content_type = file.content_type;
+    sibling->encoding = encoding;
+    return sibling;
+}
+
+// Kept only when it saves at least an eighth of the size
+std::shared_ptr<const CachedFile> compress_body(const CachedFile& file, int level) {
+    String packed;
+    if (!gzip(file.body.data(), file.body.size(), level, packed) || packed.size() > file.body.size() - file.body.size() / 8) {
+        return nullptr;
+    }
+
+    auto variant = std::make_shared<CachedFile>();
+    variant->path = file.path;
+    variant->size = packed.size();
+    variant->mtime_sec = file.mtime_sec;
+    variant->mtime_nsec = file.mtime_nsec;
+    variant->last_modified = file.last_modified;
+    variant->content_type = file.content_type;
+    variant->encoding = "gzip";
+    variant->body = BufferRef::from_string(std::move(packed));
+    variant->has_body = true;
+
+    // Same version of the file, so the suffix is what tells them apart
+    variant->etag = file.etag;
+    variant->etag.insert(variant->etag.size() - 1, "-gz");
+    return variant;
+}
+
+// Bodies of the file and its variants that are heap copies, or mappings
+size_t body_size(const CachedFile& file, bool mapped) {
+    size_t size = file.mapped == mapped ? file.body.size() : 0;
+    if (file.br) {
+        size += body_size(*file.br, mapped);
+    }
+    if (file.gzip) {
+        size += body_size(*file.gzip, mapped);
+    }
+    return size;
+}
+
+} // namespace
+
+const CachedFile& CachedFile::variant(StringView accept_encoding) const {
+    if (accept_encoding.empty()) {
+        return *this;
+    }
+    if (br && accepts_encoding(accept_encoding, "br")) {
+        return *br;
+    }
+    if (gzip && accepts_encoding(accept_encoding, "gzip")) {
+        return *gzip;
+    }
+    return *this;
+}
+
+StringView mime_type(StringView path) {
+    const size_t dot = path.rfind('.');
+    const size_t slash = path.rfind('/');
+    if (dot == StringView::npos || (slash != StringView::npos && dot < slash)) {
+        return StringView{};
+    }
+
+    const StringView ext = path.substr(dot + 1);
+    for (auto&& type : MIME_TYPES) {
+        if (equal_nocase(ext, type.first)) {
+            return type.second;
+        }
+    }
+    return StringView{};
+}
+
+FileCache::FileCache(const FileCacheOptions& options)
+:   options_(options) {
+}
+
+CachedFilePtr FileCache::get(const String& path) {
+    const uint64_t now = uv_hrtime();
+    const uint64_t check_interval = options_.check_interval_ms * 1000000;
+
+    CachedFilePtr cached;
+    {
+        std::lock_guard<std::mutex> guard{mutex_};
+        auto found = index_.find(path);
+        if (found != index_.end()) {
+            auto iter = found->second;
+            lru_.splice(lru_.begin(), lru_, iter);
+            if (now - iter->checked_at < check_interval) {
+                return iter->file;
+            }
+            cached = iter->file;
+        }
+    }
+
+    //
+    // Disk is touched outside of the lock, other workers keep hitting
+    // the cache meanwhile
+    //
+    if (cached) {
+        uv_fs_t stat_req;
+        const int stat_result = uv_fs_stat(nullptr, &stat_req, path.c_str(), nullptr);
+        const bool unchanged = stat_result == 0 && is_regular(stat_req.statbuf) && same_version(*cached, stat_req.statbuf);
+        uv_fs_req_cleanup(&stat_req);
+
+        if (unchanged) {
+            std::lock_guard<std::mutex> guard{mutex_};
+            auto found = index_.find(path);
+            if (found != index_.end() && found->second->file == cached) {
+                found->second->checked_at = now;
+            }
+            return cached;
+        }
+    }
+
+    CachedFilePtr loaded = load(path);
+
+    std::lock_guard<std::mutex> guard{mutex_};
+    auto found = index_.find(path);
+    if (found != index_.end()) {
+        erase_locked(found->second);
+    }
+    if (loaded) {
+        insert(loaded, now);
+    }
+    return loaded;
+}
+
+CachedFilePtr FileCache::get_cached(const String& path) {
+    const uint64_t now = uv_hrtime();
+
+    std::lock_guard<std::mutex> guard{mutex_};
+    auto found = index_.find(path);
+    if (found == index_.end() || now - found->second->checked_at >= options_.check_interval_ms * 1000000) {
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, found->second);
+    return found->second->file;
+}
+
+CachedFilePtr FileCache::load(const String& path) const {
+    auto file = read_file(path, options_.max_file_size, options_.max_mapped_file_size);
+    if (!file) {
+        return nullptr;
+    }
+    file->content_type = mime_type(path);
+
+    file->br = load_sibling(*file, ".br", "br", options_);
+    file->gzip = load_sibling(*file, ".gz", "gzip", options_);
+    if (!file->gzip && file->has_body && options_.gzip_level > 0 && compressible_type(file->content_type)) {
+        file->gzip = compress_body(*file, options_.gzip_level);
+    }
+    return file;
+}
+
+void FileCache::insert(CachedFilePtr file, uint64_t now) {
+    bytes_ += body_size(*file, false);
+    mapped_ += body_size(*file, true);
+    lru_.push_front(Entry{file, now});
+    index_[file->path] = lru_.begin();
+
+    while (lru_.size() > 1
+            && (bytes_ > options_.max_size || mapped_ > options_.max_mapped_size || lru_.size() > options_.max_entries)) {
+        erase_locked(std::prev(lru_.end()));
+    }
+}
+
+void FileCache::erase_locked(Lru::iterator iter) {
+    bytes_ -= body_size(*iter->file, false);
+    mapped_ -= body_size(*iter->file, true);
+    index_.erase(iter->file->path);
+    lru_.erase(iter);
+}
+
+void FileCache::erase(const String& path) {
+    std::lock_guard<std::mutex> guard{mutex_};
+    auto found = index_.find(path);
+    if (found != index_.end()) {
+        erase_locked(found->second);
+    }
+}
+
+void FileCache::clear() {
+    std::lock_guard<std::mutex> guard{mutex_};
+    index_.clear();
+    lru_.clear();
+    bytes_ = 0;
+    mapped_ = 0;
+}
+
+size_t FileCache::size() const {
+    std::lock_guard<std::mutex> guard{mutex_};
+    return lru_.size();
+}
+
+size_t FileCache::cached_bytes() const {
+    std::lock_guard<std::mutex> guard{mutex_};
+    return bytes_;
+}
+
+size_t FileCache::mapped_bytes() const {
+    std::lock_guard<std::mutex> guard{mutex_};
+    return mapped_;
+}
+
+} // namespace enji
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include "common.h"
+
+namespace enji {
+
+//
+// Metadata of a static file, and the whole content when it's small
+//
+struct CachedFile {
+    String path;
+    uint64_t size = 0;
+    int64_t mtime_sec = 0;
+    long mtime_nsec = 0;
+
+    // Quoted strong validator built from mtime and size
+    String etag;
+    String last_modified;
+
+    // Empty when the extension is unknown
+    StringView content_type;
+
+    bool has_body = false;
+    BufferRef body;
+
+    // Body is a read-only mapping of the file rather than a heap copy
+    bool mapped = false;
+
+    // "br" or "gzip" for a compressed variant, empty for the file itself
+    StringView encoding;
+
+    //
+    // Precompressed `.br`/`.gz` siblings, or a gzip made once when the
+    // file is loaded. They go away with this version of the file
+    //
+    std::shared_ptr<const CachedFile> br;
+    std::shared_ptr<const CachedFile> gzip;
+
+    bool has_variants() const { return br || gzip; }
+
+    // Best representation an Accept-Encoding value allows, br first
+    const CachedFile& variant(StringView accept_encoding) const;
+};
+
+typedef std::shared_ptr<const CachedFile> CachedFilePtr;
+
+struct FileCacheOptions {
+    // Bytes of file content kept in memory
+    size_t max_size = 32 * 1024 * 1024;
+
+    // Bigger files keep only metadata and are sent from disk
+    size_t max_file_size = 256 * 1024;
+
+    size_t max_entries = 4096;
+
+    //
+    // Bigger files up to this size are mmap()ed once and every response
+    // shares slices of the mapping, 0 sends them with sendfile instead.
+    // A mapping lives until the last response using it is done, even
+    // after the file changes or is evicted. Replace mapped files with
+    // rename(): truncating one in place faults readers of the mapping
+    //
+    size_t max_mapped_file_size = 0;
+
+    // Address space kept mapped across entries
+    size_t max_mapped_size = size_t(1) << 30;
+
+    //
+    // Entries younger than this are trusted without stat(), so hot files
+    // and conditional requests don't touch the disk. Changes show up
+    // within this interval
+    //
+    uint64_t check_interval_ms = 1000;
+
+    //
+    // zlib level for compressible files kept in memory that have no `.gz`
+    // sibling, 0 leaves them alone
+    //
+    int gzip_level = 0;
+};
+
+//
+// Bounded LRU of static files keyed by path. Entries are invalidated by
+// mtime and size checks at most once per check interval. Siblings are
+// read along with the file and are not checked on their own, so update
+// them together with it. Safe to use from any worker.
+//
+class FileCache {
+public:
+    FileCache(const FileCacheOptions& options = FileCacheOptions{});
+
+    // nullptr when the path isn't a readable regular file
+    CachedFilePtr get(const String& path);
+
+    // Entry that is still trusted without stat(), never touches the disk
+    CachedFilePtr get_cached(const String& path);
+
+    void erase(const String& path);
+    void clear();
+
+    size_t size() const;
+    size_t cached_bytes() const;
+    size_t mapped_bytes() const;
+
+    const FileCacheOptions& options() const { return options_; }
+
+private:
+    struct Entry {
+        CachedFilePtr file;
+        uint64_t checked_at;
+    };
+
+    typedef std::list<Entry> Lru;
+
+    CachedFilePtr load(const String& path) const;
+
+    void insert(CachedFilePtr file, uint64_t now);
+    void erase_locked(Lru::iterator iter);
+
+    FileCacheOptions options_;
+
+    mutable std::mutex mutex_;
+    Lru lru_;
+    std::unordered_map<String, Lru::iterator> index_;
+    size_t bytes_ = 0;
+    size_t mapped_ = 0;
+};
+
+// Content-Type by file extension, empty when unknown
+StringView mime_type(StringView path);
+
+} // namespace enji
@@ -1,17 +1,32 @@
 #include "http.h"
 #include <fcntl.h>
 #include <fstream>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
 
 #ifdef _WIN32
 #   include <io.h>
 #endif
 
+#include "compress.h"
+
 namespace enji {
 
-bool stream2stream(std::stringstream& output, std::stringstream&& input);
+const char HTTP_100_CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+const char HTTP_400_BAD_REQUEST[] = "HTTP/1.1 400 Bad Request\r\nContent-length: 0\r\nConnection: close\r\n\r\n";
+const char HTTP_413_PAYLOAD_TOO_LARGE[] = "HTTP/1.1 413 Payload Too Large\r\nContent-length: 0\r\nConnection: close\r\n\r\n";
+const char HTTP_500_INTERNAL_ERROR[] = "HTTP/1.1 500 Internal Server Error\r\nContent-length: 0\r\nConnection: close\r\n\r\n";
+
+const char CONTENT_LENGTH[] = "Content-length: ";
+
+const char CHUNK_END[] = "\r\n";
+const char LAST_CHUNK[] = "0\r\n\r\n";
 
 int cb_http_message_begin(http_parser* parser) {
-    return 0;
+    HttpConnection& handler = *reinterpret_cast<HttpConnection*>(parser->data);
+    return handler.on_message_begin();
 }
 
 int cb_http_url(http_parser* parser, const char* at, size_t len) {
@@ -62,9 +77,20 @@ http_parser_settings& get_http_settings() {
     return http_settings;
 }
 
-HttpConnection::HttpConnection(HttpServer* parent, size_t id)
-:   Connection(parent, id),
-    parent_(parent) {
+HttpConnection::HttpConnection(HttpServer* parent)
+:   Connection(parent),
+    parent_(parent),
+    max_requests_(size_t(parent->config().integer("keep_alive_max_requests", 100))),
+    max_body_size_(uint64_t(parent->config().integer("max_body_size", 0))),
+    spill_threshold_(size_t(parent->config().integer("multipart_spill_threshold", 1024 * 1024))) {
+    multipart_limits_.max_part_size = size_t(parent->config().integer("multipart_max_part_size", 0));
+    multipart_limits_.max_total_size = size_t(parent->config().integer("multipart_max_total_size", 0));
+
+    char tmp_dir[1024];
+    size_t tmp_dir_size = sizeof(tmp_dir);
+    upload_dir_ = parent->config().string("upload_tmp_dir",
+        uv_os_tmpdir(tmp_dir, &tmp_dir_size) == 0 ? String{tmp_dir, tmp_dir_size} : String{"."});
+
     parser_.reset(new http_parser{});
     http_parser_init(parser_.get(), HTTP_REQUEST);
     parser_.get()->data = this;
@@ -72,301 +98,1188 @@ HttpConnection::HttpConnection(HttpServer* parent, size_t id)
     request_.reset(new HttpRequest{});
 }
 
+int HttpConnection::on_message_begin() {
+    if (is_closing_) {
+        //
+        // Response asked to close the connection: pipelined requests after it are dropped
+        //
+        return 1;
+    }
+
+    request_->reset();
+    read_header_ = HeaderView{};
+    reading_value_ = false;
+    in_message_ = true;
+    return 0;
+}
+
 const HttpRequest& HttpConnection::request() const {
     return *request_.get();
 }
 
+StringView HttpConnection::extend(StringView head, const char* at, size_t len) {
+    if (head.empty()) {
+        input_used_ = true;
+        return StringView{at, len};
+    }
+    return request_->arena_.append(head, at, len);
+}
+
 int HttpConnection::on_http_url(const char* at, size_t len) {
-    request_->url_ += String{at, len};
+    request_->url_ = extend(request_->url_, at, len);
     return 0;
 }
 
 int HttpConnection::on_http_header_field(const char* at, size_t len) {
     check_header_finished();
-    read_header_.first += String{at, len};
+    read_header_.first = extend(read_header_.first, at, len);
     return 0;
 }
 
 int HttpConnection::on_http_header_value(const char* at, size_t len) {
-    read_header_.second += String{at, len};
+    reading_value_ = true;
+    read_header_.second = extend(read_header_.second, at, len);
     return 0;
 }
 
 int HttpConnection::on_http_headers_complete() {
     check_header_finished();
-    return 0;
-}
 
-int HttpConnection::on_http_body(const char* at, size_t len) {
-    request_->body_ += String{at, len};
+    request_->method_ = http_method_str(static_cast<http_method>(parser_->method));
+    request_->http_minor_ = parser_->http_minor;
+    request_->path_ = request_->url_.substr(0, request_->url_.find_first_of("?#"));
+
+    ++requests_served_;
+    request_->keep_alive_ = http_should_keep_alive(parser_.get()) != 0
+        && (max_requests_ == 0 || requests_served_ < max_requests_);
+
+    //
+    // Refuse before the client sends (or we wait for) an oversized body.
+    // Content-Length is ULLONG_MAX when absent, chunked bodies are counted
+    // in on_http_body
+    //
+    body_size_ = 0;
+    if (max_body_size_ && parser_->content_length != ULLONG_MAX && parser_->content_length > max_body_size_) {
+        log() << "Body of " << parser_->content_length << " bytes is over max_body_size" << std::endl;
+        reject(HTTP_413_PAYLOAD_TOO_LARGE, sizeof(HTTP_413_PAYLOAD_TOO_LARGE) - 1);
+        return -1;
+    }
+
+    if (equal_nocase(request_->header(HttpHeader::EXPECT), "100-continue")) {
+        write_chunk(BufferRef::view(HTTP_100_CONTINUE, sizeof(HTTP_100_CONTINUE) - 1));
+    }
+
+    route_ = parent_->find_route(*request_);
+    multipart_.reset();
+
+    if (route_ && route_->is_streaming()) {
+        body_stream_ = HttpBodyStream{};
+        route_->call_stream_handler(*request_, body_stream_);
+    } else {
+        start_multipart(request_->header(HttpHeader::CONTENT_TYPE));
+    }
     return 0;
 }
 
-const String MULTIPART_FORM_DATA = "multipart/form-data; boundary=";
+void HttpConnection::start_multipart(StringView content_type) {
+    const String boundary = MultipartParser::boundary(content_type);
+    if (boundary.empty()) {
+        return;
+    }
+
+    multipart_.reset(new MultipartParser{boundary, multipart_limits_});
+    collecting_ = false;
+    upload_failed_ = false;
 
-int HttpConnection::on_message_complete() {
-    message_completed_ = true;
+    //
+    // Parts with a filename become request files, form fields are skipped
+    //
+    multipart_->on_part_begin([this](const MultipartPart& part) {
+        if (part.filename.empty()) {
+            return;
+        }
+        File file;
+        file.name_ = part.name;
+        file.filename_ = part.filename;
+        file.content_type_ = part.content_type;
+        request_->files_.emplace_back(std::move(file));
+        collecting_ = true;
+    });
+    multipart_->on_part_data([this](const char* data, size_t size) {
+        if (collecting_ && !request_->files_.back().append(data, size, spill_threshold_, upload_dir_)) {
+            log() << "Can't spill upload to " << upload_dir_ << std::endl;
+            upload_failed_ = true;
+            collecting_ = false;
+        }
+    });
+    multipart_->on_part_end([this]() {
+        if (collecting_) {
+            request_->files_.back().finish();
+            collecting_ = false;
+        }
+    });
+}
 
-    auto expect_iter = request_->headers_.find("Expect");
+void HttpConnection::reject(const char* response, size_t size) {
+    write_chunk(BufferRef::view(response, size));
+    close();
+}
+
+int HttpConnection::on_http_body(const char* at, size_t len) {
+    body_size_ += len;
+    if (max_body_size_ && body_size_ > max_body_size_) {
+        log() << "Body is over max_body_size" << std::endl;
+        reject(HTTP_413_PAYLOAD_TOO_LARGE, sizeof(HTTP_413_PAYLOAD_TOO_LARGE) - 1);
+        return 1;
+    }
 
-    if (expect_iter != request_->headers_.end()) {
-        if (expect_iter->second == "100-continue") {
-            message_completed_ = false;
-            std::stringstream buf;
-            buf << "HTTP/1.1 100 Continue\r\n";
-            write_chunk(buf);
+    if (route_ && route_->is_streaming()) {
+        if (body_stream_.on_data_) {
+            body_stream_.on_data_(at, len);
         }
+        return 0;
     }
 
-    auto content_type_iter = request_->headers_.find("Content-Type");
-    if (content_type_iter != request_->headers_.end()) {
-        String boundary;
-        auto multipart = content_type_iter->second.find(MULTIPART_FORM_DATA);
-        if (multipart != String::npos) {
-            auto boundary_start = multipart + MULTIPART_FORM_DATA.size();
-            boundary = content_type_iter->second.substr(boundary_start);
+    if (multipart_) {
+        const bool parsed = multipart_->feed(at, len);
+        if (upload_failed_) {
+            reject(HTTP_500_INTERNAL_ERROR, sizeof(HTTP_500_INTERNAL_ERROR) - 1);
+            return 1;
         }
+        if (!parsed) {
+            log() << multipart_->error() << std::endl;
+            if (multipart_->too_large()) {
+                reject(HTTP_413_PAYLOAD_TOO_LARGE, sizeof(HTTP_413_PAYLOAD_TOO_LARGE) - 1);
+            } else {
+                reject(HTTP_400_BAD_REQUEST, sizeof(HTTP_400_BAD_REQUEST) - 1);
+            }
+            return 1;
+        }
+        return 0;
+    }
 
-        std::vector<size_t> occurrences;
-        size_t start = 0;
+    request_->body_ = extend(request_->body_, at, len);
+    return 0;
+}
 
-        boundary = "--" + boundary;
+namespace {
+
+const char* const HEADER_NAMES[] = {
+    "",
+    "Accept-Encoding",
+    "Connection",
+    "Content-Length",
+    "Content-Type",
+    "Expect",
+    "Host",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "Range",
+    "Transfer-Encoding",
+};
+
+static_assert(sizeof(HEADER_NAMES) / sizeof(HEADER_NAMES[0]) == size_t(HttpHeader::COUNT), "HEADER_NAMES out of sync with HttpHeader");
+
+uint32_t hash_nocase(StringView name) {
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash = (hash ^ uint32_t(std::tolower(static_cast<unsigned char>(c)))) * 16777619u;
+    }
+    return hash;
+}
 
-        while ((start = request_->body_.find(boundary, start)) != String::npos) {
-            occurrences.push_back(start);
-            start += boundary.length();
+//
+// Open addressing table of well-known names by lowercase FNV-1a hash,
+// filled once
+//
+class HeaderIds {
+public:
+    static const size_t SLOTS = 64;
+
+    HeaderIds() {
+        for (size_t id = 1; id < size_t(HttpHeader::COUNT); ++id) {
+            size_t slot = hash_nocase(HEADER_NAMES[id]) & (SLOTS - 1);
+            while (slots_[slot] != HttpHeader::UNKNOWN) {
+                slot = (slot + 1) & (SLOTS - 1);
+            }
+            slots_[slot] = HttpHeader(id);
         }
+    }
 
-        const char* body = &request_->body_.front();
-        for (size_t occurence = 1; occurence < occurrences.size(); ++occurence) {
-            auto file_content = String{
-                body + occurrences[occurence - 1] + boundary.length() + 2, // Skip boundary + "\r\n"
-                body + occurrences[occurence]
-            };
+    HttpHeader find(StringView name) const {
+        size_t slot = hash_nocase(name) & (SLOTS - 1);
+        while (slots_[slot] != HttpHeader::UNKNOWN) {
+            if (equal_nocase(name, HEADER_NAMES[size_t(slots_[slot])])) {
+                return slots_[slot];
+            }
+            slot = (slot + 1) & (SLOTS - 1);
+        }
+        return HttpHeader::UNKNOWN;
+    }
 
-            auto headers_finished = file_content.find("\r\n\r\n");
-            auto headers = file_content.substr(0, headers_finished);
+private:
+    HttpHeader slots_[SLOTS] = {};
+};
 
-            std::regex regex("Content-Disposition: form-data; name=\"(.+)\"; filename=\"(.+)\"");
-            std::smatch match_groups;
-            std::regex_search(headers, match_groups, regex);
+const HeaderIds& header_ids() {
+    static const HeaderIds ids;
+    return ids;
+}
 
-            File file;
-           
-            if (!match_groups.empty()) {
-                file.name_ = match_groups[1].str();
-                file.filename_ = match_groups[2].str();
-            }
+} // namespace
 
-            if (file.name_.empty() && file.filename_.empty()) {
-                continue;
-            }
-            
-            auto file_body = file_content.substr(headers_finished + 4);
+HttpHeader http_header_id(StringView name) {
+    return header_ids().find(name);
+}
 
-            file.body_ = std::move(file_body);
+StringView http_header_name(HttpHeader id) {
+    return HEADER_NAMES[size_t(id) < size_t(HttpHeader::COUNT) ? size_t(id) : 0];
+}
+
+HttpHeaders::HttpHeaders() {
+    clear();
+}
 
-            request_->files_.emplace_back(std::move(file));
+void HttpHeaders::add(StringView name, StringView value) {
+    const HttpHeader id = http_header_id(name);
+    entries_.push_back(Entry{id, name, value});
+    if (id != HttpHeader::UNKNOWN && first_[size_t(id)] == 0 && entries_.size() <= UINT16_MAX) {
+        first_[size_t(id)] = uint16_t(entries_.size());
+    }
+}
+
+StringView HttpHeaders::get(HttpHeader id) const {
+    const uint16_t index = first_[size_t(id)];
+    return index ? entries_[index - 1].value : StringView{};
+}
+
+StringView HttpHeaders::get(StringView name) const {
+    const HttpHeader id = http_header_id(name);
+    if (id != HttpHeader::UNKNOWN) {
+        return get(id);
+    }
+
+    for (auto&& entry : entries_) {
+        if (entry.id == HttpHeader::UNKNOWN && equal_nocase(entry.name, name)) {
+            return entry.value;
+        }
+    }
+    return StringView{};
+}
+
+void HttpHeaders::clear() {
+    entries_.clear();
+    std::fill(std::begin(first_), std::end(first_), uint16_t(0));
+}
+
+int HttpConnection::on_message_complete() {
+    in_message_ = false;
+
+    if (multipart_) {
+        const bool complete = multipart_->finish();
+        multipart_.reset();
+        if (!complete) {
+            log() << "Bad multipart body" << std::endl;
+            reject(HTTP_400_BAD_REQUEST, sizeof(HTTP_400_BAD_REQUEST) - 1);
+            return 1;
         }
     }
 
+    //
+    // Handler runs right here, so pipelined requests from one read are
+    // answered one by one in order
+    //
+    tp_parsed_ = std::chrono::high_resolution_clock::now();
+    const bool streaming = route_ && route_->is_streaming();
+    parent_->call_handler(*request_.get(), route_, streaming ? &body_stream_ : nullptr, this);
+    route_ = nullptr;
+    body_stream_ = HttpBodyStream{};
+    tp_handled_ = std::chrono::high_resolution_clock::now();
+
+    const std::chrono::duration<double> elapsed_seconds0 = tp_parsed_ - tp_accepted_;
+    const std::chrono::duration<double> elapsed_seconds = tp_handled_ - tp_parsed_;
+
+    log() << "Times: " << elapsed_seconds0.count() << "s " << elapsed_seconds.count() << "s" << std::endl;
+
+    //
+    // Deferred response still reads the request (protocol version,
+    // headers), it's released on handle_resume()
+    //
+    if (suspended_) {
+        http_parser_pause(parser_.get(), 1);
+    } else {
+        request_->reset();
+    }
     return 0;
 }
 
-void HttpConnection::handle_input(TransferBlock data) {
-    http_parser_execute(parser_.get(), &get_http_settings(), data.data, data.size);
-    
-    if (message_completed_) {
-        request_->method_ = http_method_str(static_cast<http_method>(parser_.get()->method));
-        tp_parsed_ = std::chrono::high_resolution_clock::now();
-        parent_->call_handler(*request_.get(), this);
-        tp_handled_ = std::chrono::high_resolution_clock::now();
+void HttpConnection::suspend() {
+    suspended_ = true;
+}
+
+void HttpConnection::handle_resume() {
+    suspended_ = false;
+    request_->reset();
+    http_parser_pause(parser_.get(), 0);
 
-        const std::chrono::duration<double> elapsed_seconds0 = tp_parsed_ - tp_accepted_;
-        const std::chrono::duration<double> elapsed_seconds = tp_handled_ - tp_parsed_;
+    while (!suspended_ && !held_input_.empty()) {
+        BufferRef data = std::move(held_input_.front());
+        held_input_.pop_front();
+        parse(data);
+    }
 
-        log() << "Times: " << elapsed_seconds0.count() << "s " << elapsed_seconds.count() << "s" << std::endl;
+    if (!suspended_ && input_ended_) {
+        close();
+    }
+}
+
+void HttpConnection::handle_input(const BufferRef& data) {
+    if (suspended_) {
+        held_input_.push_back(data.share());
+        return;
+    }
+    parse(data);
+}
+
+void HttpConnection::handle_input_end() {
+    //
+    // Requests held for a deferred response are still answered first
+    //
+    if (suspended_) {
+        input_ended_ = true;
+        return;
+    }
+    close();
+}
+
+void HttpConnection::parse(const BufferRef& data) {
+    input_ = &data;
+    input_used_ = false;
+
+    const size_t parsed = http_parser_execute(parser_.get(), &get_http_settings(), data.data(), data.size());
+
+    //
+    // Unfinished request keeps views into this buffer until the next reads
+    //
+    if (in_message_ && input_used_) {
+        request_->pins_.push_back(data.share());
+    }
+    input_ = nullptr;
+
+    if (HTTP_PARSER_ERRNO(parser_.get()) == HPE_PAUSED) {
+        //
+        // Handler deferred its response, the rest waits for handle_resume()
+        //
+        if (parsed < data.size()) {
+            held_input_.push_front(data.slice(parsed, data.size() - parsed));
+        }
+        return;
+    }
+
+    if (HTTP_PARSER_ERRNO(parser_.get()) != HPE_OK && !is_closing_) {
+        log() << "Bad request: " << http_errno_name(HTTP_PARSER_ERRNO(parser_.get())) << std::endl;
+        write_chunk(BufferRef::view(HTTP_400_BAD_REQUEST, sizeof(HTTP_400_BAD_REQUEST) - 1));
+        close();
     }
 }
 
 void HttpConnection::check_header_finished() {
-    // TODO: Check empty value headers with RFC
-    if (!read_header_.first.empty() && !read_header_.second.empty()) {
-        request_->headers_.insert(Header{std::move(read_header_)});
+    if (reading_value_) {
+        request_->headers_.add(read_header_.first, read_header_.second);
+        read_header_ = HeaderView{};
+        reading_value_ = false;
     }
 }
 
+const size_t HttpResponse::COALESCE_SIZE;
+
 HttpResponse::HttpResponse(HttpConnection* conn)
 :   conn_{conn},
-    response_{std::stringstream::in | std::stringstream::out | std::stringstream::binary},
-    headers_{std::stringstream::in | std::stringstream::out | std::stringstream::binary},
-    body_{std::stringstream::in | std::stringstream::out | std::stringstream::binary},
-    full_response_{std::stringstream::in | std::stringstream::out | std::stringstream::binary} {
+    headers_(conn->response_headers_),
+    keep_alive_{conn->request().keep_alive()},
+    compress_{conn->parent_->gzip_options().enabled},
+    head_request_{conn->request().method() == StringView{"HEAD"}} {
+    headers_.clear();
+}
+
+HttpResponse::HttpResponse(HttpResponse&& other)
+:   conn_{other.conn_},
+    headers_(other.headers_),
+    copies_{std::move(other.copies_)},
+    body_{std::move(other.body_)},
+    body_size_{other.body_size_},
+    headers_sent_{other.headers_sent_},
+    keep_alive_{other.keep_alive_},
+    closed_{other.closed_},
+    chunked_{other.chunked_},
+    streaming_{other.streaming_},
+    compress_{other.compress_},
+    compressible_{other.compressible_},
+    head_request_{other.head_request_},
+    code_{other.code_} {
+    other.copies_.clear();
+    other.body_.clear();
+    other.body_size_ = 0;
+    other.closed_ = true;
 }
 
 HttpResponse::~HttpResponse() {
     close();
 }
 
+std::shared_ptr<HttpResponse> HttpResponse::defer() {
+    if (closed_) {
+        throw std::runtime_error("Can't defer response. Response already closed");
+    }
+
+    conn_->suspend();
+    std::shared_ptr<HttpResponse> deferred{new HttpResponse{std::move(*this)}};
+    deferred->deferred_ = true;
+    deferred->owner_ = conn_->shared_from_this();
+    return deferred;
+}
+
+const HttpRequest& HttpResponse::request() const {
+    return conn_->request();
+}
+
+HttpServer& HttpResponse::server() const {
+    return *conn_->parent_;
+}
+
+HttpResponse& HttpResponse::compress(bool enable) {
+    compress_ = enable;
+    return *this;
+}
+
 HttpResponse& HttpResponse::response(int code) {
     code_ = code;
-    response_ << "HTTP/1.1 " << code << "\r\n";
     return *this;
 }
 
-HttpResponse& HttpResponse::add_headers(std::vector<std::pair<String, String>> headers) {
+HttpResponse& HttpResponse::add_headers(std::initializer_list<HeaderView> headers) {
     for (auto&& h : headers) {
         add_header(h.first, h.second);
     }
     return *this;
 }
 
-HttpResponse& HttpResponse::add_header(const String& name, const String& value) {
+HttpResponse& HttpResponse::add_headers(const std::vector<Header>& headers) {
+    for (auto&& h : headers) {
+        add_header(h.first, h.second);
+    }
+    return *this;
+}
+
+HttpResponse& HttpResponse::add_header(StringView name, StringView value) {
     if (headers_sent_) {
         throw std::runtime_error("Can't add headers to response. Headers already sent");
     }
-    headers_ << name << ": " << value << "\r\n";
+
+    if (equal_nocase(name, "Content-Encoding")) {
+        compress_ = false;
+    } else if (equal_nocase(name, "Content-Type")) {
+        compressible_ = compressible_type(value);
+    }
+
+    headers_.append(name.data(), name.size());
+    headers_.append(": ", 2);
+    headers_.append(value.data(), value.size());
+    headers_.append("\r\n", 2);
     return *this;
 }
 
-bool stream2stream(std::stringstream&& input, std::stringstream& output) {
-    const size_t alloc_block = 256 * 1024;
-    char tmp[alloc_block];
-    bool written_smth = false;
-    while (input) {
-        input.read(tmp, sizeof(tmp));
-        const auto size = input.gcount();
-        output.write(tmp, size);
-        if (size) {
-            written_smth = true;
-        }
+void HttpResponse::append_copy(const char* data, size_t length) {
+    if (length >= COALESCE_SIZE) {
+        seal_copies();
+        append_segment(OutputSegment{BufferRef::copy(data, length), FileRange{}});
+        return;
+    }
+    copies_.append(data, length);
+}
+
+void HttpResponse::seal_copies() {
+    if (!copies_.empty()) {
+        append_segment(OutputSegment{BufferRef::from_string(std::move(copies_)), FileRange{}});
+        copies_ = String{};
     }
-    return written_smth;
 }
 
-void stream2conn(Connection* conn, std::stringstream& buf) {
-    conn->write_chunk(buf);
+void HttpResponse::append_segment(OutputSegment&& segment) {
+    if (segment.size() == 0) {
+        return;
+    }
+    body_size_ += segment.size();
+    body_.emplace_back(std::move(segment));
 }
 
 HttpResponse& HttpResponse::body(const String& value) {
-    body_ << value;
+    append_copy(value.data(), value.size());
     return *this;
 }
 
-HttpResponse& HttpResponse::body(std::stringstream&& buf) {
-    stream2stream(std::move(buf), body_);
+HttpResponse& HttpResponse::body(String&& value) {
+    if (value.size() < COALESCE_SIZE) {
+        copies_.append(value);
+        return *this;
+    }
+    seal_copies();
+    append_segment(OutputSegment{BufferRef::from_string(std::move(value)), FileRange{}});
+    return *this;
+}
+
+HttpResponse& HttpResponse::body(const char* value) {
+    append_copy(value, std::char_traits<char>::length(value));
     return *this;
 }
 
+HttpResponse& HttpResponse::body(std::stringstream&& buf) {
+    return body(buf.str());
+}
+
 HttpResponse& HttpResponse::body(const void* data, size_t length) {
-    body_.write(static_cast<const char*>(data), length);
+    append_copy(static_cast<const char*>(data), length);
+    return *this;
+}
+
+HttpResponse& HttpResponse::body(BufferRef&& data) {
+    seal_copies();
+    append_segment(OutputSegment{std::move(data), FileRange{}});
+    return *this;
+}
+
+HttpResponse& HttpResponse::body(FileRange&& file) {
+    seal_copies();
+    append_segment(OutputSegment{BufferRef{}, std::move(file)});
+    return *this;
+}
+
+namespace {
+
+const std::pair<int, const char*> STATUS_LINES[] = {
+    {100, "HTTP/1.1 100 Continue\r\n"},
+    {101, "HTTP/1.1 101 Switching Protocols\r\n"},
+    {200, "HTTP/1.1 200 OK\r\n"},
+    {201, "HTTP/1.1 201 Created\r\n"},
+    {202, "HTTP/1.1 202 Accepted\r\n"},
+    {204, "HTTP/1.1 204 No Content\r\n"},
+    {206, "HTTP/1.1 206 Partial Content\r\n"},
+    {301, "HTTP/1.1 301 Moved Permanently\r\n"},
+    {302, "HTTP/1.1 302 Found\r\n"},
+    {303, "HTTP/1.1 303 See Other\r\n"},
+    {304, "HTTP/1.1 304 Not Modified\r\n"},
+    {307, "HTTP/1.1 307 Temporary Redirect\r\n"},
+    {308, "HTTP/1.1 308 Permanent Redirect\r\n"},
+    {400, "HTTP/1.1 400 Bad Request\r\n"},
+    {401, "HTTP/1.1 401 Unauthorized\r\n"},
+    {403, "HTTP/1.1 403 Forbidden\r\n"},
+    {404, "HTTP/1.1 404 Not Found\r\n"},
+    {405, "HTTP/1.1 405 Method Not Allowed\r\n"},
+    {406, "HTTP/1.1 406 Not Acceptable\r\n"},
+    {408, "HTTP/1.1 408 Request Timeout\r\n"},
+    {409, "HTTP/1.1 409 Conflict\r\n"},
+    {410, "HTTP/1.1 410 Gone\r\n"},
+    {411, "HTTP/1.1 411 Length Required\r\n"},
+    {412, "HTTP/1.1 412 Precondition Failed\r\n"},
+    {413, "HTTP/1.1 413 Payload Too Large\r\n"},
+    {414, "HTTP/1.1 414 URI Too Long\r\n"},
+    {415, "HTTP/1.1 415 Unsupported Media Type\r\n"},
+    {416, "HTTP/1.1 416 Range Not Satisfiable\r\n"},
+    {417, "HTTP/1.1 417 Expectation Failed\r\n"},
+    {422, "HTTP/1.1 422 Unprocessable Entity\r\n"},
+    {426, "HTTP/1.1 426 Upgrade Required\r\n"},
+    {429, "HTTP/1.1 429 Too Many Requests\r\n"},
+    {500, "HTTP/1.1 500 Internal Server Error\r\n"},
+    {501, "HTTP/1.1 501 Not Implemented\r\n"},
+    {502, "HTTP/1.1 502 Bad Gateway\r\n"},
+    {503, "HTTP/1.1 503 Service Unavailable\r\n"},
+    {504, "HTTP/1.1 504 Gateway Timeout\r\n"},
+    {505, "HTTP/1.1 505 HTTP Version Not Supported\r\n"},
+};
+
+const int FIRST_STATUS = 100;
+const int LAST_STATUS = 599;
+
+char* append_raw(char* to, StringView str) {
+    if (!str.empty()) {
+        std::memcpy(to, str.data(), str.size());
+    }
+    return to + str.size();
+}
+
+// "Content-length: N\r\n" at the end of `buf`
+StringView content_length_line(uint64_t length, char* buf, size_t size) {
+    char* end = buf + size;
+    char* pos = end;
+    *--pos = '\n';
+    *--pos = '\r';
+    do {
+        *--pos = char('0' + length % 10);
+        length /= 10;
+    } while (length);
+    pos -= sizeof(CONTENT_LENGTH) - 1;
+    std::memcpy(pos, CONTENT_LENGTH, sizeof(CONTENT_LENGTH) - 1);
+    return StringView{pos, size_t(end - pos)};
+}
+
+BufferRef build_head(StringView status, StringView date, StringView server, StringView headers,
+        StringView content_length, StringView connection) {
+    BufferRef head = BufferRef::allocate(status.size() + 6 + date.size() + 2 + server.size() + headers.size()
+        + content_length.size() + connection.size() + 2);
+    char* pos = head.mutable_data();
+    pos = append_raw(pos, status);
+    pos = append_raw(pos, "Date: ");
+    pos = append_raw(pos, date);
+    pos = append_raw(pos, "\r\n");
+    pos = append_raw(pos, server);
+    pos = append_raw(pos, headers);
+    pos = append_raw(pos, content_length);
+    pos = append_raw(pos, connection);
+    append_raw(pos, "\r\n");
+    return head;
+}
+
+enum ConnectionLine {
+    CONNECTION_DEFAULT,
+    CONNECTION_KEEP_ALIVE,
+    CONNECTION_CLOSE,
+    CONNECTION_LINES
+};
+
+const char* const CONNECTION_HEADERS[CONNECTION_LINES] = {
+    "",
+    "Connection: keep-alive\r\n",
+    "Connection: close\r\n",
+};
+
+const int CANNED_CODES[] = {304, 404, 503};
+const size_t CANNED_COUNT = sizeof(CANNED_CODES) / sizeof(CANNED_CODES[0]);
+
+//
+// Whole heads of empty responses without headers of their own, like the
+// router's 404. They carry Date, so they can't be static: each thread
+// rebuilds them when the second or the server changes and shares them
+// by reference count in between. Redirects always have a Location and
+// 405 an Allow, they go the regular way
+//
+BufferRef canned_head(const String& server, int code, ConnectionLine connection) {
+    struct Canned {
+        const String* server = nullptr;
+        String date;
+        BufferRef heads[CANNED_COUNT][CONNECTION_LINES];
+    };
+    thread_local Canned canned;
+
+    size_t index = 0;
+    while (index < CANNED_COUNT && CANNED_CODES[index] != code) {
+        ++index;
+    }
+    if (index == CANNED_COUNT) {
+        return BufferRef{};
+    }
+
+    const StringView date = cached_http_date();
+    if (canned.server != &server || StringView{canned.date} != date) {
+        canned.server = &server;
+        canned.date = date.str();
+        for (size_t i = 0; i < CANNED_COUNT; ++i) {
+            const StringView content_length = CANNED_CODES[i] == 304 ? StringView{} : StringView{"Content-length: 0\r\n"};
+            for (size_t line = 0; line < CONNECTION_LINES; ++line) {
+                canned.heads[i][line] = build_head(http_status_line(CANNED_CODES[i]), date, server, StringView{},
+                    content_length, CONNECTION_HEADERS[line]);
+            }
+        }
+    }
+    return canned.heads[index][connection].share();
+}
+
+} // namespace
+
+StringView http_status_line(int code) {
+    //
+    // Direct index by code, filled once from STATUS_LINES
+    //
+    static const std::vector<StringView> lines = [] {
+        std::vector<StringView> lines(LAST_STATUS - FIRST_STATUS + 1);
+        for (auto&& line : STATUS_LINES) {
+            lines[line.first - FIRST_STATUS] = line.second;
+        }
+        return lines;
+    }();
+
+    if (code < FIRST_STATUS || code > LAST_STATUS) {
+        return StringView{};
+    }
+    return lines[code - FIRST_STATUS];
+}
+
+void HttpResponse::encode_body() {
+    //
+    // Same types as the file cache compresses: images and archives are
+    // compressed already and get no Vary for a variant that never exists
+    //
+    const GzipOptions& options = server().gzip_options();
+    if (!compressible_ || body_size_ < options.min_size || code_ == 204 || code_ == 304) {
+        return;
+    }
+    for (auto&& segment : body_) {
+        if (segment.is_file()) {
+            return;
+        }
+    }
+
+    add_header("Vary", "Accept-Encoding");
+    if (!accepts_encoding(request().header(HttpHeader::ACCEPT_ENCODING), "gzip")) {
+        return;
+    }
+
+    GzipEncoder encoder{options.level};
+    for (auto&& segment : body_) {
+        encoder.write(segment.buf.data(), segment.buf.size());
+    }
+    if (!encoder.finish() || encoder.result().size() >= body_size_) {
+        return;
+    }
+
+    body_.clear();
+    body_size_ = 0;
+    append_segment(OutputSegment{BufferRef::from_string(std::move(encoder.result())), FileRange{}});
+    add_header("Content-Encoding", "gzip");
+}
+
+void HttpResponse::send_head() {
+    ConnectionLine connection = CONNECTION_DEFAULT;
+    if (!keep_alive_) {
+        connection = CONNECTION_CLOSE;
+    } else if (conn_->request().http_minor_ == 0) {
+        connection = CONNECTION_KEEP_ALIVE;
+    }
+
+    const String& server = conn_->parent_->server_header();
+    if (headers_.empty() && body_size_ == 0 && !streaming_) {
+        BufferRef canned = canned_head(server, code_, connection);
+        if (!canned.empty()) {
+            conn_->write_chunk(std::move(canned));
+            headers_sent_ = true;
+            return;
+        }
+    }
+
+    //
+    // Everything but the caller's headers is prebuilt: status line from
+    // the table, Date cached for the second, Server from the config
+    //
+    StringView status = http_status_line(code_);
+    char status_buf[32];
+    if (status.empty()) {
+        const int status_size = std::snprintf(status_buf, sizeof(status_buf), "HTTP/1.1 %d \r\n", code_);
+        status = StringView{status_buf, size_t(status_size)};
+    }
+
+    //
+    // 1xx, 204 and 304 have no body to frame. HEAD gets the length of
+    // the body it would have had
+    //
+    const bool no_content = code_ < 200 || code_ == 204 || code_ == 304;
+    char content_length_buf[48];
+    StringView content_length;
+    if (chunked_ && !no_content) {
+        content_length = "Transfer-Encoding: chunked\r\n";
+    } else if (!streaming_ && !no_content) {
+        content_length = content_length_line(body_size_, content_length_buf, sizeof(content_length_buf));
+    }
+
+    conn_->write_chunk(build_head(status, cached_http_date(), server, headers_, content_length, CONNECTION_HEADERS[connection]));
+    headers_sent_ = true;
+}
+
+bool HttpResponse::has_body() const {
+    return !head_request_ && code_ >= 200 && code_ != 204 && code_ != 304;
+}
+
+HttpResponse& HttpResponse::chunked() {
+    if (headers_sent_) {
+        throw std::runtime_error("Can't switch response to chunked. Headers already sent");
+    }
+
+    streaming_ = true;
+    if (conn_->request().http_minor_ >= 1) {
+        chunked_ = true;
+    } else {
+        keep_alive_ = false;
+    }
+
+    seal_copies();
+    send_head();
     return *this;
 }
 
 void HttpResponse::flush() {
+    seal_copies();
+
     if (!headers_sent_) {
-        if (!stream2stream(std::move(response_), full_response_)) {
-            full_response_ << "HTTP/1.1 200\r\n";
+        if (compress_) {
+            encode_body();
         }
+        send_head();
+    }
 
-        body_.seekp(0, std::ios::end);
-        auto body_size = body_.tellp();
+    if (!has_body()) {
+        //
+        // Bytes after these headers would be read as the next response.
+        // Dropped file segments close their descriptors
+        //
+        body_.clear();
+        body_size_ = 0;
+        return;
+    }
 
-        std::ostringstream body_size_stream;
-        body_size_stream << body_size;
-        add_header("Content-length", body_size_stream.str());
+    if (body_.empty()) {
+        return;
+    }
 
-        stream2stream(std::move(headers_), full_response_);
-        headers_sent_ = true;
+    if (chunked_) {
+        char size_line[24];
+        const int size_line_size = std::snprintf(size_line, sizeof(size_line), "%llx\r\n",
+            static_cast<unsigned long long>(body_size_));
+        conn_->write_chunk(BufferRef::copy(size_line, size_line_size));
+    }
 
-        full_response_ << "\r\n";
+    for (auto&& segment : body_) {
+        if (segment.is_file()) {
+            conn_->write_file(std::move(segment.file));
+        } else {
+            conn_->write_chunk(std::move(segment.buf));
+        }
     }
+    body_.clear();
+    body_size_ = 0;
 
-    stream2stream(std::move(body_), full_response_);
-    stream2conn(conn_, full_response_);
+    if (chunked_) {
+        conn_->write_chunk(BufferRef::view(CHUNK_END, sizeof(CHUNK_END) - 1));
+    }
+
+    if (streaming_ && !conn_->is_writable()) {
+        conn_->wait_writable();
+    }
 }
 
 void HttpResponse::close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+
     flush();
-    conn_->close();
+    if (chunked_ && has_body()) {
+        conn_->write_chunk(BufferRef::view(LAST_CHUNK, sizeof(LAST_CHUNK) - 1));
+    }
+
+    if (!keep_alive_) {
+        conn_->close();
+    }
+
+    if (deferred_) {
+        conn_->resume_input();
+    }
 }
 
 HttpRoute::HttpRoute(const char* path, Handler handler)
 :   path_{path},
-    handler_{handler},
-    path_match_(path) {
+    handler_{handler} {
 }
 
 HttpRoute::HttpRoute(String&& path, Handler handler)
 :   path_{path},
-    handler_{handler},
-    path_match_(path) {
+    handler_{handler} {
 }
 
 HttpRoute::HttpRoute(const char* path, FuncHandler handler)
 :   path_{path},
-    handler_{handler},
-    path_match_(path) {
+    handler_{handler} {
 }
 
 HttpRoute::HttpRoute(String&& path, FuncHandler handler)
 :   path_{path},
-    handler_{handler},
-    path_match_(path) {
+    handler_{handler} {
+}
+
+HttpRoute::HttpRoute(const char* method, const char* path, Handler handler)
+:   method_{method},
+    path_{path},
+    handler_{handler} {
+}
+
+HttpRoute::HttpRoute(const char* method, const char* path, FuncHandler handler)
+:   method_{method},
+    path_{path},
+    handler_{handler} {
 }
 
-std::smatch HttpRoute::match(const String& url) const {
-    std::smatch match_groups;
-    std::regex_search(url, match_groups, path_match_);
-    return match_groups;
+HttpRoute HttpRoute::streaming(const char* method, const char* path, StreamHandler handler) {
+    HttpRoute route{method, path, Handler{}};
+    route.stream_handler_ = std::move(handler);
+    return route;
 }
 
-void HttpRoute::call_handler(const HttpRequest& req, HttpResponse& out) {
+void HttpRoute::call_handler(const HttpRequest& req, HttpResponse& out) const {
     handler_(req, out);
 }
 
+void HttpRoute::call_stream_handler(const HttpRequest& req, HttpBodyStream& stream) const {
+    stream_handler_(req, stream);
+}
+
+namespace {
+
+FileCacheOptions file_cache_options(const Config& config) {
+    FileCacheOptions options;
+    options.max_size = size_t(config.integer("static_cache_size", int(options.max_size)));
+    options.max_file_size = size_t(config.integer("static_cache_max_file", int(options.max_file_size)));
+    options.check_interval_ms = uint64_t(config.integer("static_cache_check_ms", int(options.check_interval_ms)));
+    options.max_mapped_file_size = size_t(config.integer("static_mmap_max_file", 0));
+    options.max_mapped_size = size_t(config.integer("static_mmap_size", int(options.max_mapped_size)));
+    if (config.integer("gzip_responses", 0)) {
+        options.gzip_level = config.integer("gzip_level", GzipOptions{}.level);
+    }
+    return options;
+}
+
+// Empty `server_name` drops the header
+String server_header_line(const Config& config) {
+    const String name = config.string("server_name", "enji");
+    return name.empty() ? String{} : "Server: " + name + "\r\n";
+}
+
+GzipOptions gzip_config(const Config& config) {
+    GzipOptions options;
+    options.enabled = config.integer("gzip_responses", 0) != 0;
+    options.level = config.integer("gzip_level", options.level);
+    options.min_size = size_t(config.integer("gzip_min_size", int(options.min_size)));
+    return options;
+}
+
+} // namespace
+
 HttpServer::HttpServer()
-:   Server{} {
+:   Server{},
+    gzip_{gzip_config(config())},
+    file_cache_{file_cache_options(config())},
+    server_header_{server_header_line(config())} {
     create_connection([this]() {
-        return std::make_shared<HttpConnection>(this, counter_++); });
+        return std::make_shared<HttpConnection>(this); });
 }
 
 HttpServer::HttpServer(Config& config)
-:   Server{config} {
+:   Server{config},
+    gzip_{gzip_config(config)},
+    file_cache_{file_cache_options(config)},
+    server_header_{server_header_line(config)} {
     create_connection([this]() {
-        return std::make_shared<HttpConnection>(this, counter_++); });
+        return std::make_shared<HttpConnection>(this); });
 }
 
 void HttpServer::routes(std::vector<HttpRoute>&& routes) {
     routes_ = std::move(routes);
+
+    router_.clear();
+    for (size_t i = 0; i < routes_.size(); ++i) {
+        router_.add(routes_[i].method(), routes_[i].path(), i);
+    }
 }
 
 void HttpServer::add_route(HttpRoute&& route) {
-    routes_.emplace_back(route);
+    router_.add(route.method(), route.path(), routes_.size());
+    routes_.emplace_back(std::move(route));
+}
+
+const HttpRoute* HttpServer::find_route(HttpRequest& request) const {
+    const StringView path = request.path();
+    if (router_.find(request.method(), path.data(), path.size(), request.match_)) {
+        return &routes_[request.match_.index];
+    }
+    return nullptr;
 }
 
-void HttpServer::call_handler(HttpRequest& request, HttpConnection* bind) {
-    bool matched = false;
+void HttpServer::call_handler(HttpRequest& request, const HttpRoute* route, HttpBodyStream* stream, HttpConnection* bind) {
     HttpResponse out{bind};
 
-    for (auto&& route : routes_) {
-        auto matches = route.match(request.url());
-        if (!matches.empty()) {
-            request.set_match(matches);
-            route.call_handler(request, out);
-            matched = true;
+    if (stream) {
+        if (stream->on_complete_) {
+            stream->on_complete_(request, out);
         }
-    }
-
-    if (!matched) {
+    } else if (route) {
+        route->call_handler(request, out);
+    } else if (request.match_.method_not_allowed) {
+        String allow;
+        for (StringView method : request.match_.allowed_methods) {
+            if (!allow.empty()) {
+                allow += ", ";
+            }
+            allow.append(method.data(), method.size());
+        }
+        out.response(405).add_header("Allow", allow);
+    } else {
         out.response(404);
     }
 
     bind->log() << request.method() << " " << request.url() << " " << out.code() << std::endl;
 }
 
+File::File(File&& other)
+:   name_{std::move(other.name_)},
+    filename_{std::move(other.filename_)},
+    content_type_{std::move(other.content_type_)},
+    body_{std::move(other.body_)},
+    path_{std::move(other.path_)},
+    size_{other.size_},
+    fd_{other.fd_} {
+    other.path_.clear();
+    other.fd_ = -1;
+}
+
+File& File::operator = (File&& other) {
+    //
+    // Old content goes away with `moved`
+    //
+    File moved{std::move(other)};
+    std::swap(name_, moved.name_);
+    std::swap(filename_, moved.filename_);
+    std::swap(content_type_, moved.content_type_);
+    std::swap(body_, moved.body_);
+    std::swap(path_, moved.path_);
+    std::swap(size_, moved.size_);
+    std::swap(fd_, moved.fd_);
+    return *this;
+}
+
+File::~File() {
+    finish();
+    if (!path_.empty()) {
+        uv_fs_t unlink_req;
+        uv_fs_unlink(nullptr, &unlink_req, path_.c_str(), nullptr);
+        uv_fs_req_cleanup(&unlink_req);
+    }
+}
+
+namespace {
+
+bool write_all(uv_file fd, const char* data, size_t size) {
+    while (size > 0) {
+        uv_fs_t write_req;
+        uv_buf_t buf = uv_buf_init(const_cast<char*>(data), static_cast<unsigned int>(size));
+        const int written = uv_fs_write(nullptr, &write_req, fd, &buf, 1, -1, nullptr);
+        uv_fs_req_cleanup(&write_req);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+std::atomic<uint64_t> temp_file_counter{0};
+
+} // namespace
+
+bool File::append(const char* data, size_t size, size_t spill_threshold, const String& tmp_dir) {
+    size_ += size;
+
+    if (path_.empty() && body_.size() + size <= spill_threshold) {
+        body_.append(data, size);
+        return true;
+    }
+
+    if (path_.empty()) {
+        std::ostringstream name;
+        name << "enji-upload-" << uv_hrtime() << "-" << temp_file_counter++;
+        path_ = path_join(tmp_dir, name.str());
+
+        uv_fs_t open_req;
+        uv_fs_open(nullptr, &open_req, path_.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600, nullptr);
+        fd_ = static_cast<uv_file>(open_req.result);
+        uv_fs_req_cleanup(&open_req);
+        if (fd_ < 0) {
+            path_.clear();
+            return false;
+        }
+
+        if (!write_all(fd_, body_.data(), body_.size())) {
+            return false;
+        }
+        String{}.swap(body_);
+    }
+
+    return write_all(fd_, data, size);
+}
+
+void File::finish() {
+    if (fd_ >= 0) {
+        uv_fs_t close_req;
+        uv_fs_close(nullptr, &close_req, fd_, nullptr);
+        uv_fs_req_cleanup(&close_req);
+        fd_ = -1;
+    }
+}
+
+bool File::save_as(const String& filename) const {
+    if (!spilled()) {
+        std::ofstream out{filename.c_str(), std::ios::binary};
+        out.write(body_.data(), body_.size());
+        return bool(out);
+    }
+
+    //
+    // Temp file is complete and closed by the time handlers run. Once it's
+    // renamed away the unlink in ~File just finds nothing
+    //
+    uv_fs_t rename_req;
+    const int renamed = uv_fs_rename(nullptr, &rename_req, path_.c_str(), filename.c_str(), nullptr);
+    uv_fs_req_cleanup(&rename_req);
+    if (renamed == 0) {
+        return true;
+    }
+
+    //
+    // Temp dir on another filesystem
+    //
+    std::ifstream in{path_.c_str(), std::ios::binary};
+    std::ofstream out{filename.c_str(), std::ios::binary};
+    out << in.rdbuf();
+    return bool(out);
+}
+
+void HttpRequest::reset() {
+    method_ = StringView{};
+    url_ = StringView{};
+    path_ = StringView{};
+    body_ = StringView{};
+    keep_alive_ = false;
+    headers_.clear();
+    files_.clear();
+    pins_.clear();
+    arena_.reset();
+}
+
+StringView HttpRequest::capture(size_t index) const {
+    return index < match_.captures.size() ? match_.captures[index] : StringView{};
+}
+
+StringView HttpRequest::param(StringView name) const {
+    if (match_.names) {
+        for (size_t i = 0; i < match_.names->size(); ++i) {
+            if ((*match_.names)[i] == name) {
+                return capture(i + 1);
+            }
+        }
+    }
+    return StringView{};
+}
+
 String match1_filename(const HttpRequest& req) {
-   return req.match()[1].str();
+   return req.capture(1).str();
 }
 
 HttpRoute::Handler serve_static(std::function<String(const HttpRequest& req)> request2file, const Config& config) {
@@ -379,7 +1292,7 @@ HttpRoute::Handler serve_static(std::function<String(const HttpRequest& req)> re
         }};
 #else
     return HttpRoute::Handler{
-        [&]
+        [request2file, &config]
         (const HttpRequest& req, HttpResponse& out) {
             static_file(request2file(req), out, config);
         }
@@ -398,7 +1311,7 @@ HttpRoute::Handler serve_static(const String& root_dir, std::function<String(con
     }};
 #else
     return HttpRoute::Handler{
-        [&]
+        [root_dir, request2file]
         (const HttpRequest& req, HttpResponse& out)
         {
             const auto request_file = request2file(req);
@@ -411,42 +1324,408 @@ void static_file(const String& filename, HttpResponse& out, const Config& config
     response_file(path_join(config["STATIC_ROOT_DIR"].str(), filename), out);
 }
 
-void response_file(const String& filename, HttpResponse& out) {
-    uv_fs_t open_req;
+namespace {
 
-#ifdef _WIN32
-    int open_mode = _S_IREAD;
-#else
-    int open_mode = S_IRUSR;
-#endif
-    
-    uv_fs_open(nullptr, &open_req, filename.c_str(), O_RDONLY, open_mode, nullptr);
-    auto open_req_exit = Defer{[&open_req] { uv_fs_req_cleanup(&open_req); }};
-    const auto fd = static_cast<uv_file>(open_req.result);
+// Longer sets are ignored, they only serve to amplify the work per request
+const size_t MAX_BYTE_RANGES = 32;
 
-    if (fd < 0) {
-        out.response(404);
+StringView trim_spaces(StringView str) {
+    while (!str.empty() && (str[0] == ' ' || str[0] == '\t')) {
+        str = str.substr(1);
+    }
+    while (!str.empty() && (str[str.size() - 1] == ' ' || str[str.size() - 1] == '\t')) {
+        str = str.substr(0, str.size() - 1);
+    }
+    return str;
+}
+
+// Digits only, false when empty or out of range
+bool parse_uint(StringView str, uint64_t& value) {
+    if (str.empty() || str.size() > 19) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return false;
+        }
+        value = value * 10 + uint64_t(str[i] - '0');
+    }
+    return true;
+}
+
+} // namespace
+
+bool parse_byte_ranges(StringView header, uint64_t size, std::vector<ByteRange>& ranges) {
+    ranges.clear();
+
+    const StringView unit = "bytes=";
+    if (header.size() <= unit.size() || !equal_nocase(header.substr(0, unit.size()), unit)) {
+        return false;
+    }
+
+    size_t specs = 0;
+    uint64_t total = 0;
+    size_t pos = unit.size();
+    while (pos <= header.size()) {
+        size_t end = header.find(',', pos);
+        if (end == StringView::npos) {
+            end = header.size();
+        }
+        const StringView spec = trim_spaces(header.substr(pos, end - pos));
+        pos = end + 1;
+        if (spec.empty()) {
+            continue;
+        }
+        if (++specs > MAX_BYTE_RANGES) {
+            return false;
+        }
+
+        const size_t dash = spec.find('-');
+        if (dash == StringView::npos) {
+            return false;
+        }
+
+        uint64_t first;
+        uint64_t last;
+        if (dash == 0) {
+            // Suffix: the last N bytes
+            if (!parse_uint(spec.substr(1), last)) {
+                return false;
+            }
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            const uint64_t length = std::min(last, size);
+            ranges.push_back(ByteRange{size - length, length});
+            total += length;
+            continue;
+        }
+
+        if (!parse_uint(spec.substr(0, dash), first)) {
+            return false;
+        }
+        if (dash + 1 == spec.size()) {
+            last = UINT64_MAX;
+        } else if (!parse_uint(spec.substr(dash + 1), last) || last < first) {
+            return false;
+        }
+
+        if (first >= size) {
+            continue;
+        }
+        const uint64_t length = std::min(last, size - 1) - first + 1;
+        ranges.push_back(ByteRange{first, length});
+        total += length;
+    }
+
+    if (specs == 0) {
+        return false;
+    }
+
+    //
+    // Overlapping pieces adding up to more than the body: whole body is
+    // cheaper for both sides
+    //
+    return ranges.size() < 2 || total <= size;
+}
+
+namespace {
+
+// Weak comparison against "*" or a list of entity tags
+bool etag_matches(StringView tags, StringView etag) {
+    size_t pos = 0;
+    while (pos < tags.size()) {
+        size_t end = tags.find(',', pos);
+        if (end == StringView::npos) {
+            end = tags.size();
+        }
+
+        StringView tag = trim_spaces(tags.substr(pos, end - pos));
+        if (tag.size() > 2 && tag[0] == 'W' && tag[1] == '/') {
+            tag = tag.substr(2);
+        }
+
+        if (tag == StringView{"*"} || tag == etag) {
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+//
+// Validators of a request, copied when the answer comes after the
+// request object is reused
+//
+struct Conditions {
+    bool applies = false;
+    String if_none_match;
+    String if_modified_since;
+    String accept_encoding;
+
+    // Only GET asks for ranges
+    String range;
+    String if_range;
+
+    explicit Conditions(const HttpRequest& req)
+    :   applies{req.method() == StringView{"GET"} || req.method() == StringView{"HEAD"}},
+        if_none_match{req.header(HttpHeader::IF_NONE_MATCH).str()},
+        if_modified_since{req.header(HttpHeader::IF_MODIFIED_SINCE).str()},
+        accept_encoding{req.header(HttpHeader::ACCEPT_ENCODING).str()} {
+        if (req.method() == StringView{"GET"}) {
+            range = req.header(HttpHeader::RANGE).str();
+            if_range = req.header(HttpHeader::IF_RANGE).str();
+        }
+    }
+
+    //
+    // If-Range keeps the range only while the client's copy is current:
+    // strong ETag match or the exact Last-Modified date
+    //
+    bool wants_range(const CachedFile& file) const {
+        if (range.empty()) {
+            return false;
+        }
+        if (if_range.empty()) {
+            return true;
+        }
+        if (if_range[0] == '"') {
+            return if_range == file.etag;
+        }
+
+        int64_t date;
+        return parse_http_date(if_range, date) && date == file.mtime_sec;
+    }
+
+    bool not_modified(const CachedFile& file) const {
+        if (!applies) {
+            return false;
+        }
+
+        //
+        // If-None-Match wins over If-Modified-Since when both are present
+        //
+        if (!if_none_match.empty()) {
+            return etag_matches(if_none_match, file.etag);
+        }
+
+        int64_t since;
+        return !if_modified_since.empty() && parse_http_date(if_modified_since, since) && file.mtime_sec <= since;
+    }
+};
+
+bool open_regular(const String& filename, std::shared_ptr<FileHandle>& file, size_t& size) {
+    file = FileHandle::open(filename);
+    if (!file) {
+        return false;
+    }
+
+    uv_fs_t stat_req;
+    const int stat_result = uv_fs_fstat(nullptr, &stat_req, file->fd(), nullptr);
+    auto stat_req_exit = Defer{[&stat_req] { uv_fs_req_cleanup(&stat_req); }};
+    if (stat_result != 0 || (stat_req.statbuf.st_mode & S_IFMT) != S_IFREG) {
+        file.reset();
+        return false;
+    }
+    size = static_cast<size_t>(stat_req.statbuf.st_size);
+    return true;
+}
+
+//
+// `variant` is `cached` or one of its compressed forms. `file` is open
+// only for a modified variant that isn't kept in memory
+//
+void respond_file(const CachedFile& cached, const CachedFile& variant, const Conditions& conditions, bool not_modified,
+        std::shared_ptr<FileHandle> file, size_t size, HttpResponse& out) {
+    // Already as compressed as it gets
+    out.compress(false);
+
+    if (cached.has_variants()) {
+        out.add_header("Vary", "Accept-Encoding");
+    }
+    out.add_header("ETag", variant.etag);
+    out.add_header("Last-Modified", variant.last_modified);
+    if (not_modified) {
+        out.response(304);
         return;
     }
 
-    uv_fs_t read_req;
-    const size_t alloc_block = 64 * 1024;
-    size_t offset = 0;
-    char mem[alloc_block];
-    while (true) {
-        uv_buf_t buf[] = {uv_buf_init(mem, sizeof(mem))};
-        int read = uv_fs_read(nullptr, &read_req, fd, buf, 1, offset, nullptr);
-        auto read_req_exit = Defer{[&read_req] { uv_fs_req_cleanup(&read_req); }};
-        out.body(buf[0].base, read);
-        offset += read;
-        if (static_cast<unsigned int>(read) < buf[0].len) {
-            break;
+    out.add_header("Accept-Ranges", "bytes");
+    if (!variant.encoding.empty()) {
+        out.add_header("Content-Encoding", variant.encoding);
+    }
+
+    const uint64_t total = variant.has_body ? variant.body.size() : size;
+    std::vector<ByteRange> ranges;
+    const bool partial = conditions.wants_range(variant) && parse_byte_ranges(conditions.range, total, ranges);
+
+    char content_range[80];
+    if (partial && ranges.empty()) {
+        std::snprintf(content_range, sizeof(content_range), "bytes */%llu", static_cast<unsigned long long>(total));
+        out.response(416);
+        out.add_header("Content-Range", content_range);
+        return;
+    }
+
+    //
+    // Cached bodies are sliced. Files too big to keep in memory are only
+    // described here, the event loop moves the bytes
+    //
+    auto send = [&](uint64_t offset, uint64_t length) {
+        if (variant.has_body) {
+            out.body(variant.body.slice(size_t(offset), size_t(length)));
+        } else {
+            out.body(FileRange{file, int64_t(offset), size_t(length)});
         }
+    };
+    auto format_range = [&](const ByteRange& range) {
+        std::snprintf(content_range, sizeof(content_range), "bytes %llu-%llu/%llu",
+            static_cast<unsigned long long>(range.offset),
+            static_cast<unsigned long long>(range.offset + range.length - 1),
+            static_cast<unsigned long long>(total));
+        return StringView{content_range};
+    };
+
+    if (!partial) {
+        if (!variant.content_type.empty()) {
+            out.add_header("Content-Type", variant.content_type);
+        }
+        send(0, total);
+        return;
+    }
+
+    out.response(206);
+    if (ranges.size() == 1) {
+        if (!variant.content_type.empty()) {
+            out.add_header("Content-Type", variant.content_type);
+        }
+        out.add_header("Content-Range", format_range(ranges[0]));
+        send(ranges[0].offset, ranges[0].length);
+        return;
     }
 
-    uv_fs_t close_req;
-    uv_fs_close(nullptr, &close_req, fd, nullptr);
-    auto close_req_exit = Defer{[&close_req] { uv_fs_req_cleanup(&close_req); }};
+    char boundary[24];
+    std::snprintf(boundary, sizeof(boundary), "%016llx", static_cast<unsigned long long>(uv_hrtime()));
+    out.add_header("Content-Type", String{"multipart/byteranges; boundary="} + boundary);
+
+    for (auto&& range : ranges) {
+        String part_head{"\r\n--"};
+        part_head += boundary;
+        if (!variant.content_type.empty()) {
+            part_head += "\r\nContent-Type: ";
+            part_head.append(variant.content_type.data(), variant.content_type.size());
+        }
+        part_head += "\r\nContent-Range: ";
+        const StringView formatted = format_range(range);
+        part_head.append(formatted.data(), formatted.size());
+        part_head += "\r\n\r\n";
+
+        out.body(std::move(part_head));
+        send(range.offset, range.length);
+    }
+    out.body(String{"\r\n--"} + boundary + "--\r\n");
+}
+
+//
+// Disk part of response_file on the threadpool, for handlers that run
+// on the event loop itself
+//
+struct FileResponse {
+    uv_work_t req;
+    std::shared_ptr<HttpResponse> out;
+    FileCache* cache;
+    String filename;
+    Conditions conditions;
+
+    CachedFilePtr cached;
+    const CachedFile* variant = nullptr;
+    bool not_modified = false;
+    std::shared_ptr<FileHandle> file;
+    size_t size = 0;
+
+    FileResponse(const HttpRequest& req)
+    :   conditions{req} {
+    }
+};
+
+void cb_file_response_work(uv_work_t* req) {
+    auto work = reinterpret_cast<FileResponse*>(req->data);
+    work->cached = work->cache->get(work->filename);
+    if (!work->cached) {
+        return;
+    }
+
+    work->variant = &work->cached->variant(work->conditions.accept_encoding);
+    work->not_modified = work->conditions.not_modified(*work->variant);
+    if (!work->not_modified && !work->variant->has_body && !open_regular(work->variant->path, work->file, work->size)) {
+        work->cached.reset();
+    }
+}
+
+void cb_file_response_done(uv_work_t* req, int status) {
+    std::unique_ptr<FileResponse> work{reinterpret_cast<FileResponse*>(req->data)};
+    if (work->cached) {
+        respond_file(*work->cached, *work->variant, work->conditions, work->not_modified, std::move(work->file), work->size, *work->out);
+    } else {
+        work->out->response(404);
+    }
+    work->out->close();
+}
+
+} // namespace
+
+void response_file(const String& filename, HttpResponse& out) {
+    FileCache& cache = out.server().file_cache();
+    const HttpRequest& req = out.request();
+
+    if (!EventLoop::current()) {
+        //
+        // Worker thread: blocking on the disk is fine here
+        //
+        auto cached = cache.get(filename);
+        if (!cached) {
+            out.response(404);
+            return;
+        }
+
+        const Conditions conditions{req};
+        const CachedFile& variant = cached->variant(conditions.accept_encoding);
+        const bool not_modified = conditions.not_modified(variant);
+        std::shared_ptr<FileHandle> file;
+        size_t size = 0;
+        if (!not_modified && !variant.has_body && !open_regular(variant.path, file, size)) {
+            out.response(404);
+            return;
+        }
+        respond_file(*cached, variant, conditions, not_modified, std::move(file), size, out);
+        return;
+    }
+
+    //
+    // Event loop thread: answer from memory or go to the threadpool,
+    // a slow disk must not stall every other connection of the loop
+    //
+    auto cached = cache.get_cached(filename);
+    if (cached) {
+        const Conditions conditions{req};
+        const CachedFile& variant = cached->variant(conditions.accept_encoding);
+        const bool not_modified = conditions.not_modified(variant);
+        if (not_modified || variant.has_body) {
+            respond_file(*cached, variant, conditions, not_modified, nullptr, 0, out);
+            return;
+        }
+    }
+
+    auto work = new FileResponse{req};
+    work->req.data = work;
+    work->cache = &cache;
+    work->filename = filename;
+    work->out = out.defer();
+    if (uv_queue_work(EventLoop::current()->loop(), &work->req, cb_file_response_work, cb_file_response_done) != 0) {
+        work->out->response(503);
+        delete work;
+    }
 }
 
 namespace shortcuts {
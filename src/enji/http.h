@@ -1,85 +1,311 @@
 #pragma once
 
 #include <http_parser.h>
-#include <regex>
+#include "file_cache.h"
+#include "multipart.h"
+#include "router.h"
 #include "server.h"
 
 namespace enji {
 
 class HttpConnection;
+class HttpServer;
 
 typedef std::pair<String, String> Header;
+typedef std::pair<StringView, StringView> HeaderView;
+
+//
+// Well-known request headers, resolved once when the header is parsed
+//
+enum class HttpHeader : uint8_t {
+    UNKNOWN,
+    ACCEPT_ENCODING,
+    CONNECTION,
+    CONTENT_LENGTH,
+    CONTENT_TYPE,
+    EXPECT,
+    HOST,
+    IF_MODIFIED_SINCE,
+    IF_NONE_MATCH,
+    IF_RANGE,
+    RANGE,
+    TRANSFER_ENCODING,
+    COUNT
+};
+
+// "HTTP/1.1 404 Not Found\r\n", empty for codes without a reason phrase
+StringView http_status_line(int code);
+
+// Case-insensitive, UNKNOWN for anything not in HttpHeader
+HttpHeader http_header_id(StringView name);
+
+StringView http_header_name(HttpHeader id);
+
+//
+// Flat list of headers in arrival order plus the position of the first
+// occurrence of each well-known one, so lookups by id are O(1). Names and
+// values are views, see HttpRequest.
+//
+class HttpHeaders {
+public:
+    struct Entry {
+        HttpHeader id;
+        StringView name;
+        StringView value;
+    };
+
+    HttpHeaders();
+
+    void add(StringView name, StringView value);
+
+    // First value, empty when missing
+    StringView get(HttpHeader id) const;
+    StringView get(StringView name) const;
+
+    bool has(HttpHeader id) const { return first_[size_t(id)] != 0; }
+
+    std::vector<Entry>::const_iterator begin() const { return entries_.begin(); }
+    std::vector<Entry>::const_iterator end() const { return entries_.end(); }
 
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    void clear();
+
+private:
+    std::vector<Entry> entries_;
+
+    // Index + 1 into entries_, 0 when absent
+    uint16_t first_[size_t(HttpHeader::COUNT)];
+};
+
+//
+// Uploaded multipart/form-data file. Small ones stay in body(), ones over
+// `multipart_spill_threshold` go to a temp file at path() that is removed
+// with the File unless save_as() moved it away.
+//
 class File {
 public:
+    File() {}
+    File(File&& other);
+    File& operator = (File&& other);
+    ~File();
+
     const String& name() const { return name_; }
     const String& filename() const { return filename_; }
+    const String& content_type() const { return content_type_; }
     const String& body() const { return body_; }
 
+    bool spilled() const { return !path_.empty(); }
+    const String& path() const { return path_; }
+
+    size_t size() const { return size_; }
+
+    // Moves the temp file or writes the body to `filename`
+    bool save_as(const String& filename) const;
+
+    // False when the temp file can't be written
+    bool append(const char* data, size_t size, size_t spill_threshold, const String& tmp_dir);
+    void finish();
+
 public:
     String name_;
     String filename_;
+    String content_type_;
     String body_;
+    String path_;
+    size_t size_ = 0;
+    uv_file fd_ = -1;
 };
 
+//
+// Parsed request. Fields are views into the read buffers the request came
+// in, which stay pinned until the response is done; pieces split between
+// reads are joined in the request arena. Both are released in one shot
+// after the handler returns, so handlers copy what they keep.
+//
 class HttpRequest {
 public:
     friend class HttpConnection;
 
-    const String& method() const { return method_; }
+    StringView method() const { return method_; }
 
-    const String& url() const { return url_; }
+    StringView url() const { return url_; }
 
-    const String& body() const { return body_; }
+    StringView body() const { return body_; }
+
+    // First header with this name (case-insensitive), empty when missing
+    StringView header(HttpHeader id) const { return headers_.get(id); }
+    StringView header(StringView name) const { return headers_.get(name); }
+
+    const HttpHeaders& headers() const { return headers_; }
 
     const std::vector<File>& files() const { return files_; }
 
-    void set_match(const std::smatch& match) { match_ = match; }
-    const std::smatch& match() const { return match_; }
+    // Connection stays open after the response to this request
+    bool keep_alive() const { return keep_alive_; }
+
+    // Path without the query string
+    StringView path() const { return path_; }
+
+    // Route captures: 0 is the whole path, then parameters in pattern order
+    // (or regex groups). Empty when out of range
+    StringView capture(size_t index) const;
+
+    // Named route parameter, like `id` for `/gram/{id}`
+    StringView param(StringView name) const;
 
 private:
-    String method_;
-    String url_;
-    bool url_ready_;
+    friend class HttpResponse;
+    friend class HttpServer;
 
-    std::smatch match_;
+    void reset();
 
-    std::multimap<String, String> headers_;
+    StringView method_;
+    StringView url_;
+    StringView path_;
 
-    String body_;
+    bool keep_alive_ = false;
+    unsigned short http_minor_ = 1;
+
+    RouteMatch match_;
+
+    HttpHeaders headers_;
+
+    StringView body_;
 
     std::vector<File> files_;
+
+    // Read buffers the views above point into
+    std::vector<BufferRef> pins_;
+    Arena arena_;
 };
 
+//
+// Response builder. Headers are serialized into the connection's reusable
+// buffer and go out with the status line as one piece; the body is a list
+// of segments handed to the write path as they are. Small copied pieces are
+// gathered into one segment, big or owned ones are passed without a copy.
+//
 class HttpResponse {
 public:
+    // Copied pieces below this size are merged into one segment
+    static const size_t COALESCE_SIZE = 4 * 1024;
+
     HttpResponse(HttpConnection* conn);
     ~HttpResponse();
 
     HttpResponse& response(int code);
-    HttpResponse& add_headers(std::vector<std::pair<String, String>> headers);
-    HttpResponse& add_header(const String& name, const String& value);
+    HttpResponse& add_headers(std::initializer_list<HeaderView> headers);
+    HttpResponse& add_headers(const std::vector<Header>& headers);
+    HttpResponse& add_header(StringView name, StringView value);
     HttpResponse& body(const String& value);
+    HttpResponse& body(String&& value);
+    HttpResponse& body(const char* value);
     HttpResponse& body(std::stringstream&& buf);
     HttpResponse& body(const void* data, size_t length);
 
+    // Zero-copy segment: owned buffer, slice or BufferRef::view of static data
+    HttpResponse& body(BufferRef&& data);
+
+    //
+    // File range sent from the page cache with sendfile(2) where available.
+    // The response keeps the descriptor until the range is on the wire
+    //
+    HttpResponse& body(FileRange&& file);
+
+    //
+    // Streaming mode: headers go out now with Transfer-Encoding: chunked,
+    // every flush() sends what was added since as one chunk and close()
+    // sends the last one. flush() waits while the client is behind on
+    // reading, so memory stays bounded. HTTP/1.0 clients get the raw body
+    // ended by closing the connection.
+    //
+    HttpResponse& chunked();
+
+    //
+    // Gzip the body when the client accepts it and Content-Type is text-like,
+    // see GzipOptions. Defaults to `gzip_responses`; setting Content-Encoding
+    // turns it off
+    //
+    HttpResponse& compress(bool enable);
+
     int code() const { return code_; }
 
+    const HttpRequest& request() const;
+    HttpServer& server() const;
+
+    //
+    // Finish the response later, from any thread. The connection stops
+    // parsing requests until the returned response is closed, so
+    // pipelined answers stay in order and request() stays valid. For
+    // handlers on the loop thread that wait for the threadpool
+    //
+    std::shared_ptr<HttpResponse> defer();
+
     void flush();
     void close();
 
 private:
+    HttpResponse(HttpResponse&& other);
+
+    void append_copy(const char* data, size_t length);
+    void seal_copies();
+    void append_segment(OutputSegment&& segment);
+
+    void encode_body();
+
+    // False for HEAD and for 1xx, 204 and 304, which end at the headers
+    bool has_body() const;
+
+    void send_head();
+
     HttpConnection* conn_;
 
-    std::stringstream response_;
-    std::stringstream headers_;
-    std::stringstream body_;
+    // HttpConnection::response_headers_, reused between responses
+    String& headers_;
 
-    std::stringstream full_response_;
+    String copies_;
+    std::vector<OutputSegment> body_;
+    size_t body_size_ = 0;
 
     bool headers_sent_ = false;
+    bool keep_alive_;
+    bool closed_ = false;
+    bool chunked_ = false;
+    bool streaming_ = false;
+    bool deferred_ = false;
+    bool compress_;
+    bool compressible_ = false;
+    bool head_request_;
 
     int code_ = 200;
+
+    // Deferred response keeps its connection alive
+    ConnectionPtr owner_;
+};
+
+//
+// Body of a request to a streaming route, delivered chunk by chunk as it
+// is read from the socket instead of being buffered in HttpRequest::body().
+// Chunks are only valid during the call.
+//
+class HttpBodyStream {
+public:
+    typedef std::function<void (const char* data, size_t size)> DataHandler;
+    typedef std::function<void (const HttpRequest&, HttpResponse&)> CompleteHandler;
+
+    void on_data(DataHandler handler) { on_data_ = std::move(handler); }
+
+    // Runs once the whole body is in, like a regular route handler
+    void on_complete(CompleteHandler handler) { on_complete_ = std::move(handler); }
+
+private:
+    friend class HttpConnection;
+    friend class HttpServer;
+
+    DataHandler on_data_;
+    CompleteHandler on_complete_;
 };
 
 struct HttpRoute {
@@ -87,23 +313,48 @@ public:
     typedef void (*FuncHandler)(const HttpRequest&, HttpResponse&);
     typedef std::function<void (const HttpRequest&, HttpResponse&)> Handler;
 
+    // Called when headers are parsed to set up the body stream
+    typedef std::function<void (const HttpRequest&, HttpBodyStream&)> StreamHandler;
+
     HttpRoute(const char* path, Handler handler);
     HttpRoute(String&& path, Handler handler);
 
     HttpRoute(const char* path, FuncHandler handler);
     HttpRoute(String&& path, FuncHandler handler);
 
-    std::smatch match(const String& url) const;
+    // Only requests with `method` go to the handler, others get 405
+    HttpRoute(const char* method, const char* path, Handler handler);
+    HttpRoute(const char* method, const char* path, FuncHandler handler);
+
+    // Route whose handler sees headers first and the body as a stream
+    static HttpRoute streaming(const char* method, const char* path, StreamHandler handler);
+
+    const String& method() const { return method_; }
+    const String& path() const { return path_; }
+
+    bool is_streaming() const { return bool(stream_handler_); }
 
-    void call_handler(const HttpRequest&, HttpResponse&);
+    void call_handler(const HttpRequest&, HttpResponse&) const;
+    void call_stream_handler(const HttpRequest&, HttpBodyStream&) const;
 
 private:
     String method_;
     String name_;
     String path_;
     Handler handler_;
+    StreamHandler stream_handler_;
+};
 
-    std::regex path_match_;
+//
+// Response filter for dynamic bodies, from config: gzip_responses turns
+// it on, gzip_level and gzip_min_size tune it. Only compressible
+// Content-Types are gzipped; streaming responses and file ranges go out
+// as they are
+//
+struct GzipOptions {
+    bool enabled = false;
+    int level = 6;
+    size_t min_size = 1024;
 };
 
 class HttpServer : public Server {
@@ -113,24 +364,55 @@ public:
 
     void routes(std::vector<HttpRoute>&& routes);
     void add_route(HttpRoute&& route);
-    std::vector<HttpRoute>& routes() { return routes_; }
     const std::vector<HttpRoute>& routes() const { return routes_; }
 
-    void call_handler(HttpRequest& request, HttpConnection* bind);
+    // Matches the request, keeping captures in it. Null when nothing matches
+    const HttpRoute* find_route(HttpRequest& request) const;
+
+    void call_handler(HttpRequest& request, const HttpRoute* route, HttpBodyStream* stream, HttpConnection* bind);
+
+    //
+    // Static files served by response_file. Limits come from config:
+    // static_cache_size, static_cache_max_file, static_cache_check_ms,
+    // static_mmap_max_file and static_mmap_size for the mmap mode.
+    // With gzip_responses compressible ones are gzipped once per version
+    //
+    FileCache& file_cache() { return file_cache_; }
+
+    const GzipOptions& gzip_options() const { return gzip_; }
+
+    // "Server: ...\r\n" from config `server_name`, empty when disabled
+    const String& server_header() const { return server_header_; }
 
 protected:
     std::vector<HttpRoute> routes_;
+    Router router_;
+    GzipOptions gzip_;
+    FileCache file_cache_;
+    String server_header_;
 };
 
 class HttpConnection : public Connection {
 public:
-    HttpConnection(HttpServer* parent, size_t id);
+    HttpConnection(HttpServer* parent);
 
-    void handle_input(TransferBlock data) override;
+    void handle_input(const BufferRef& data) override;
+    void handle_input_end() override;
 
     const HttpRequest& request() const;
 
 private:
+    void parse(const BufferRef& data);
+
+    //
+    // Deferred response: hold input until it's done. Both run on the
+    // input thread, closing the response posts the resume there
+    //
+    void suspend();
+    void handle_resume() override;
+
+    int on_message_begin();
+
     int on_http_url(const char* at, size_t len);
 
     int on_http_header_field(const char* at, size_t len);
@@ -145,6 +427,14 @@ private:
 
     void check_header_finished();
 
+    void start_multipart(StringView content_type);
+
+    // Canned error response, then close
+    void reject(const char* response, size_t size);
+
+    // View of [at, at + len) joined to `head`, see HttpRequest
+    StringView extend(StringView head, const char* at, size_t len);
+
     friend int cb_http_message_begin(http_parser*);
     friend int cb_http_url(http_parser*, const char*, size_t);
     friend int cb_http_status(http_parser*, const char*, size_t);
@@ -161,11 +451,39 @@ private:
 
     std::unique_ptr<http_parser> parser_;
 
-    typedef std::pair<String, String> RHeader;
+    HeaderView read_header_;
+    bool reading_value_ = false;
+
+    size_t requests_served_ = 0;
+    size_t max_requests_;
+
+    const HttpRoute* route_ = nullptr;
+    HttpBodyStream body_stream_;
+
+    uint64_t body_size_ = 0;
+    uint64_t max_body_size_;
+
+    std::unique_ptr<MultipartParser> multipart_;
+    MultipartLimits multipart_limits_;
+    size_t spill_threshold_;
+    String upload_dir_;
+    bool collecting_ = false;
+    bool upload_failed_ = false;
 
-    RHeader read_header_;
+    // Buffer handle_input is parsing and whether the request points into it
+    const BufferRef* input_ = nullptr;
+    bool input_used_ = false;
+    bool in_message_ = false;
 
-    bool message_completed_ = false;
+    // Input that arrived while a deferred response is pending
+    bool suspended_ = false;
+    std::deque<BufferRef> held_input_;
+    bool input_ended_ = false;
+
+    friend class HttpResponse;
+
+    // Header lines of the response being built
+    String response_headers_;
 
 protected:
     std::chrono::time_point<std::chrono::high_resolution_clock> tp_parsed_;
@@ -180,8 +498,25 @@ HttpRoute::Handler serve_static(const String& root_dir, std::function<String(con
 
 void static_file(const String& filename, HttpResponse& out, const Config& config = ServerConfig);
 
+//
+// Sends the file with ETag/Last-Modified validation, Accept-Encoding
+// variants and byte ranges. Partial responses only move the requested
+// bytes: slices of the cached body or file ranges for sendfile
+//
 void response_file(const String& filename, HttpResponse& out);
 
+struct ByteRange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+//
+// Ranges of a `Range: bytes=...` value within `size` bytes, in request
+// order. False when the value should be ignored and the whole body sent;
+// an empty result then means nothing is satisfiable (416)
+//
+bool parse_byte_ranges(StringView header, uint64_t size, std::vector<ByteRange>& ranges);
+
 namespace shortcuts {
 
     void temporary_redirect(const String& redirect_to, HttpResponse& out);
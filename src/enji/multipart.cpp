@@ -0,0 +1,300 @@
+#include "multipart.h"
+#include <algorithm>
+#include <cstring>
+
+namespace enji {
+
+namespace {
+
+StringView trim(StringView str) {
+    size_t begin = 0;
+    size_t end = str.size();
+    while (begin < end && (str[begin] == ' ' || str[begin] == '\t')) {
+        ++begin;
+    }
+    while (end > begin && (str[end - 1] == ' ' || str[end - 1] == '\t')) {
+        --end;
+    }
+    return str.substr(begin, end - begin);
+}
+
+StringView unquote(StringView str) {
+    str = trim(str);
+    if (str.size() >= 2 && str[0] == '"' && str[str.size() - 1] == '"') {
+        return str.substr(1, str.size() - 2);
+    }
+    return str;
+}
+
+//
+// Value of `key=value` parameter of a header like
+// `form-data; name="file"; filename="a.png"`
+//
+StringView header_param(StringView header, StringView key) {
+    size_t pos = header.find(';');
+    while (pos != StringView::npos) {
+        const size_t next = header.find(';', pos + 1);
+        const StringView param = header.substr(pos + 1, next == StringView::npos ? StringView::npos : next - pos - 1);
+        const size_t eq = param.find('=');
+        if (eq != StringView::npos && equal_nocase(trim(param.substr(0, eq)), key)) {
+            return unquote(param.substr(eq + 1));
+        }
+        pos = next;
+    }
+    return StringView{};
+}
+
+} // namespace
+
+MultipartParser::MultipartParser(const String& boundary, const MultipartLimits& limits)
+:   delimiter_{"\r\n--" + boundary},
+    limits_(limits),
+    // The first delimiter may come without the leading CRLF
+    matched_{2} {
+}
+
+String MultipartParser::boundary(StringView content_type) {
+    const size_t semicolon = content_type.find(';');
+    if (!equal_nocase(trim(content_type.substr(0, std::min(semicolon, content_type.size()))), "multipart/form-data")) {
+        return String{};
+    }
+    return header_param(content_type, "boundary").str();
+}
+
+bool MultipartParser::fail(const char* error, bool too_large) {
+    if (error_.empty()) {
+        error_ = error;
+        too_large_ = too_large;
+    }
+    return false;
+}
+
+bool MultipartParser::emit(const char* data, size_t size) {
+    if (size == 0) {
+        return true;
+    }
+
+    part_size_ += size;
+    if (limits_.max_part_size && part_size_ > limits_.max_part_size) {
+        return fail("Multipart part is too large", true);
+    }
+
+    if (on_part_data_) {
+        on_part_data_(data, size);
+    }
+    return true;
+}
+
+size_t MultipartParser::scan(const char* data, size_t size, bool emit_data, bool& found) {
+    found = false;
+    size_t pos = 0;
+
+    if (matched_ > 0) {
+        while (pos < size && matched_ < delimiter_.size() && data[pos] == delimiter_[matched_]) {
+            ++pos;
+            ++matched_;
+        }
+
+        if (matched_ == delimiter_.size()) {
+            matched_ = 0;
+            found = true;
+            return pos;
+        }
+
+        if (pos == size) {
+            return pos;
+        }
+
+        //
+        // Held bytes turned out to be data. CR only starts the delimiter,
+        // so no new match can begin inside them
+        //
+        if (emit_data && !emit(delimiter_.data(), matched_)) {
+            return size;
+        }
+        matched_ = 0;
+    }
+
+    while (pos < size) {
+        const char* cr = static_cast<const char*>(std::memchr(data + pos, '\r', size - pos));
+        const size_t start = cr ? cr - data : size;
+
+        if (emit_data && !emit(data + pos, start - pos)) {
+            return size;
+        }
+        pos = start;
+        if (pos == size) {
+            break;
+        }
+
+        size_t match = 0;
+        while (pos + match < size && match < delimiter_.size() && data[pos + match] == delimiter_[match]) {
+            ++match;
+        }
+
+        if (match == delimiter_.size()) {
+            found = true;
+            return pos + match;
+        }
+
+        if (pos + match == size) {
+            matched_ = match;
+            return size;
+        }
+
+        if (emit_data && !emit(data + pos, 1)) {
+            return size;
+        }
+        ++pos;
+    }
+
+    return pos;
+}
+
+bool MultipartParser::parse_headers() {
+    part_ = MultipartPart{};
+    part_size_ = 0;
+
+    size_t pos = 0;
+    const StringView headers{headers_};
+    while (pos < headers.size()) {
+        size_t eol = headers.find(StringView{"\r\n", 2}, pos);
+        if (eol == StringView::npos) {
+            eol = headers.size();
+        }
+
+        const StringView line = headers.substr(pos, eol - pos);
+        pos = eol + 2;
+        if (line.empty()) {
+            continue;
+        }
+
+        const size_t colon = line.find(':');
+        if (colon == StringView::npos) {
+            return fail("Malformed multipart header");
+        }
+
+        const StringView name = trim(line.substr(0, colon));
+        const StringView value = trim(line.substr(colon + 1));
+
+        if (equal_nocase(name, "Content-Disposition")) {
+            part_.name = header_param(value, "name").str();
+            part_.filename = header_param(value, "filename").str();
+        } else if (equal_nocase(name, "Content-Type")) {
+            part_.content_type = value.str();
+        }
+        part_.headers.emplace_back(name.str(), value.str());
+    }
+
+    headers_.clear();
+    if (on_part_begin_) {
+        on_part_begin_(part_);
+    }
+    return true;
+}
+
+bool MultipartParser::feed(const char* data, size_t size) {
+    if (failed()) {
+        return false;
+    }
+
+    total_size_ += size;
+    if (limits_.max_total_size && total_size_ > limits_.max_total_size) {
+        return fail("Multipart body is too large", true);
+    }
+
+    size_t pos = 0;
+    while (pos < size) {
+        const char c = data[pos];
+
+        switch (state_) {
+        case State::PREAMBLE:
+        case State::DATA: {
+            bool found = false;
+            pos += scan(data + pos, size - pos, state_ == State::DATA, found);
+            if (failed()) {
+                return false;
+            }
+            if (found) {
+                if (state_ == State::DATA && on_part_end_) {
+                    on_part_end_();
+                }
+                state_ = State::AFTER_DELIMITER;
+            }
+            break;
+        }
+
+        case State::AFTER_DELIMITER:
+            ++pos;
+            if (c == '-') {
+                state_ = State::AFTER_DASH;
+            } else if (c == '\r') {
+                state_ = State::AFTER_CR;
+            } else if (c != ' ' && c != '\t') {
+                return fail("Malformed multipart boundary");
+            }
+            break;
+
+        case State::AFTER_DASH:
+            ++pos;
+            if (c != '-') {
+                return fail("Malformed multipart boundary");
+            }
+            state_ = State::EPILOGUE;
+            break;
+
+        case State::AFTER_CR:
+            ++pos;
+            if (c != '\n') {
+                return fail("Malformed multipart boundary");
+            }
+            state_ = State::HEADERS;
+            break;
+
+        case State::HEADERS: {
+            //
+            // Headers are small: collect them up to the empty line
+            //
+            const size_t wanted = std::min(size - pos, limits_.max_header_size + 4 - headers_.size());
+            const size_t before = headers_.size();
+            headers_.append(data + pos, wanted);
+
+            const size_t search_from = before >= 3 ? before - 3 : 0;
+            size_t end = headers_.compare(0, 2, "\r\n") == 0 ? 0 : headers_.find("\r\n\r\n", search_from);
+            if (end == String::npos) {
+                if (headers_.size() > limits_.max_header_size) {
+                    return fail("Multipart headers are too large", true);
+                }
+                pos += wanted;
+                break;
+            }
+
+            const size_t headers_end = end == 0 ? 2 : end + 4;
+            pos += headers_end - before;
+            headers_.resize(end);
+            if (!parse_headers()) {
+                return false;
+            }
+            state_ = State::DATA;
+            break;
+        }
+
+        case State::EPILOGUE:
+            return true;
+        }
+    }
+
+    return true;
+}
+
+bool MultipartParser::finish() {
+    if (failed()) {
+        return false;
+    }
+    if (state_ != State::EPILOGUE) {
+        return fail("Truncated multipart body");
+    }
+    return true;
+}
+
+} // namespace enji
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.h"
+
+namespace enji {
+
+//
+// Headers of one multipart/form-data part
+//
+struct MultipartPart {
+    String name;
+    String filename;
+    String content_type;
+
+    std::vector<std::pair<String, String>> headers;
+};
+
+struct MultipartLimits {
+    // 0 means unlimited
+    size_t max_part_size = 0;
+    size_t max_total_size = 0;
+
+    size_t max_header_size = 8 * 1024;
+};
+
+//
+// Incremental multipart/form-data parser (RFC 2046 / 7578). Body chunks go
+// in as they arrive from the socket, part headers and part data come out
+// through the callbacks without buffering the body.
+//
+class MultipartParser {
+public:
+    typedef std::function<void (const MultipartPart&)> PartBegin;
+    typedef std::function<void (const char* data, size_t size)> PartData;
+    typedef std::function<void ()> PartEnd;
+
+    MultipartParser(const String& boundary, const MultipartLimits& limits = MultipartLimits{});
+
+    void on_part_begin(PartBegin callback) { on_part_begin_ = std::move(callback); }
+    void on_part_data(PartData callback) { on_part_data_ = std::move(callback); }
+    void on_part_end(PartEnd callback) { on_part_end_ = std::move(callback); }
+
+    // False on malformed input or exceeded limits, see error()
+    bool feed(const char* data, size_t size);
+
+    // False unless the closing boundary was seen
+    bool finish();
+
+    bool failed() const { return !error_.empty(); }
+    const String& error() const { return error_; }
+
+    // Limits hit rather than malformed input, worth a 413
+    bool too_large() const { return too_large_; }
+
+    // Boundary parameter of a multipart Content-Type, empty when missing
+    static String boundary(StringView content_type);
+
+private:
+    enum class State {
+        PREAMBLE,
+        AFTER_DELIMITER,
+        AFTER_DASH,
+        AFTER_CR,
+        HEADERS,
+        DATA,
+        EPILOGUE
+    };
+
+    bool fail(const char* error, bool too_large = false);
+
+    // Consumes data until a delimiter is matched, passing the rest to `emit`
+    // when `emit_data` is set. Returns bytes consumed
+    size_t scan(const char* data, size_t size, bool emit_data, bool& found);
+
+    bool emit(const char* data, size_t size);
+
+    bool parse_headers();
+
+    // "\r\n--" + boundary
+    String delimiter_;
+    MultipartLimits limits_;
+
+    State state_ = State::PREAMBLE;
+
+    // Bytes of delimiter_ matched at the end of the previous chunk
+    size_t matched_;
+
+    String headers_;
+    MultipartPart part_;
+    size_t part_size_ = 0;
+    size_t total_size_ = 0;
+
+    String error_;
+    bool too_large_ = false;
+
+    PartBegin on_part_begin_;
+    PartData on_part_data_;
+    PartEnd on_part_end_;
+};
+
+} // namespace enji
@@ -0,0 +1,310 @@
+#include "router.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace enji {
+
+struct Router::Node {
+    enum ParamType {
+        PARAM_INT,
+        PARAM_ANY,
+        PARAM_TYPES
+    };
+
+    // Static children sorted by segment
+    std::vector<std::pair<String, std::unique_ptr<Node>>> children;
+
+    std::unique_ptr<Node> params[PARAM_TYPES];
+
+    // Indices into Router::routes_
+    std::vector<size_t> exact;
+    std::vector<size_t> rest;
+
+    // `^` literals ending below this node: the rest of the literal after
+    // its last '/' and the route. Longest first
+    std::vector<std::pair<String, size_t>> prefix;
+
+    Node& child(const char* seg, size_t len) {
+        auto iter = std::lower_bound(children.begin(), children.end(), String{seg, len},
+            [](const std::pair<String, std::unique_ptr<Node>>& a, const String& b) { return a.first < b; });
+        if (iter == children.end() || iter->first.compare(0, String::npos, seg, len) != 0) {
+            iter = children.emplace(iter, String{seg, len}, std::unique_ptr<Node>{new Node{}});
+        }
+        return *iter->second;
+    }
+
+    const Node* find_child(const char* seg, size_t len) const {
+        auto iter = std::lower_bound(children.begin(), children.end(), std::make_pair(seg, len),
+            [](const std::pair<String, std::unique_ptr<Node>>& a, const std::pair<const char*, size_t>& b) {
+                return a.first.compare(0, String::npos, b.first, b.second) < 0; });
+        if (iter == children.end() || iter->first.compare(0, String::npos, seg, len) != 0) {
+            return nullptr;
+        }
+        return iter->second.get();
+    }
+};
+
+namespace {
+
+const char* const REGEX_SPECIAL = ".[]()*+?{}|\\^$";
+
+bool is_digits(const char* str, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+const size_t RouteMatch::NOT_FOUND;
+
+Router::Router()
+:   root_{new Node{}} {
+}
+
+Router::~Router() = default;
+
+Router::Router(Router&&) = default;
+
+Router& Router::operator=(Router&&) = default;
+
+void Router::clear() {
+    root_.reset(new Node{});
+    routes_.clear();
+    regex_routes_.clear();
+}
+
+void Router::add(const String& method, const String& pattern, size_t index) {
+    if (pattern.empty()) {
+        throw std::invalid_argument("Empty route pattern");
+    }
+
+    const size_t route_id = routes_.size();
+    Route route{method, index, {}, nullptr};
+
+    if (pattern[0] == '^') {
+        const bool anchored_end = pattern.size() > 1 && pattern.back() == '$'
+            && pattern[pattern.size() - 2] != '\\';
+        String literal = pattern.substr(1, pattern.size() - 1 - (anchored_end ? 1 : 0));
+
+        if (literal.empty() || literal[0] != '/' || literal.find_first_of(REGEX_SPECIAL) != String::npos) {
+            route.regex.reset(new std::regex{pattern});
+            regex_routes_.push_back(route_id);
+            routes_.push_back(std::move(route));
+            return;
+        }
+
+        //
+        // Plain literal under regex anchors: no need for std::regex.
+        // Without `$` it is a plain string prefix, as with the regex:
+        // `^/api` matches `/api/view` and `/apiview` too
+        //
+        Node* node = root_.get();
+        const char* pos = literal.data();
+        const char* end = pos + literal.size();
+        if (!anchored_end) {
+            end = pos + literal.rfind('/');
+        }
+        while (pos < end) {
+            const char* seg = pos + 1;
+            const char* seg_end = std::find(seg, end, '/');
+            node = &node->child(seg, seg_end - seg);
+            pos = seg_end;
+        }
+
+        if (anchored_end) {
+            node->exact.push_back(route_id);
+        } else {
+            String tail = literal.substr(end - literal.data() + 1);
+            auto iter = std::find_if(node->prefix.begin(), node->prefix.end(),
+                [&tail](const std::pair<String, size_t>& p) { return p.first.size() < tail.size(); });
+            node->prefix.emplace(iter, std::move(tail), route_id);
+        }
+        routes_.push_back(std::move(route));
+        return;
+    }
+
+    if (pattern[0] != '/') {
+        throw std::invalid_argument("Route pattern must start with '/' or '^': " + pattern);
+    }
+
+    Node* node = root_.get();
+    const char* pos = pattern.data();
+    const char* end = pos + pattern.size();
+    while (pos < end) {
+        const char* seg = pos + 1;
+        const char* seg_end = std::find(seg, end, '/');
+        const size_t seg_len = seg_end - seg;
+        pos = seg_end;
+
+        if (seg_len < 2 || seg[0] != '{' || seg[seg_len - 1] != '}') {
+            node = &node->child(seg, seg_len);
+            continue;
+        }
+
+        String name{seg + 1, seg_len - 2};
+        if (!name.empty() && name.back() == '*') {
+            if (pos != end) {
+                throw std::invalid_argument("Rest parameter must be the last segment: " + pattern);
+            }
+            name.pop_back();
+            route.names.push_back(std::move(name));
+            node->rest.push_back(route_id);
+            routes_.push_back(std::move(route));
+            return;
+        }
+
+        Node::ParamType type = Node::PARAM_ANY;
+        const size_t colon = name.find(':');
+        if (colon != String::npos) {
+            const String type_name = name.substr(colon + 1);
+            if (type_name == "int") {
+                type = Node::PARAM_INT;
+            } else if (type_name != "str") {
+                throw std::invalid_argument("Unknown parameter type '" + type_name + "' in " + pattern);
+            }
+            name.resize(colon);
+        }
+
+        route.names.push_back(std::move(name));
+        if (!node->params[type]) {
+            node->params[type].reset(new Node{});
+        }
+        node = node->params[type].get();
+    }
+
+    node->exact.push_back(route_id);
+    routes_.push_back(std::move(route));
+}
+
+bool Router::method_matches(const Route& route, StringView method, RouteMatch& match) const {
+    if (route.method.empty() || StringView{route.method} == method) {
+        return true;
+    }
+
+    match.method_not_allowed = true;
+    const StringView allowed{route.method};
+    if (std::find(match.allowed_methods.begin(), match.allowed_methods.end(), allowed) == match.allowed_methods.end()) {
+        match.allowed_methods.push_back(allowed);
+    }
+    return false;
+}
+
+bool Router::pick(size_t route_id, StringView method, RouteMatch& match) const {
+    const Route& route = routes_[route_id];
+    if (!method_matches(route, method, match)) {
+        return false;
+    }
+    match.index = route.index;
+    match.names = &route.names;
+    return true;
+}
+
+bool Router::pick(const std::vector<size_t>& routes, StringView method, RouteMatch& match) const {
+    for (size_t route_id : routes) {
+        if (pick(route_id, method, match)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Router::pick_prefix(const Node& node, const char* pos, const char* end,
+        StringView method, RouteMatch& match) const {
+    for (auto&& prefix : node.prefix) {
+        const String& tail = prefix.first;
+        if (size_t(end - pos) <= tail.size() || tail.compare(0, String::npos, pos + 1, tail.size()) != 0) {
+            continue;
+        }
+        if (pick(prefix.second, method, match)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Router::find_in(const Node& node, const char* pos, const char* end,
+        StringView method, std::vector<StringView>& captures,
+        RouteMatch& match) const {
+    if (pos == end) {
+        return pick(node.exact, method, match);
+    }
+
+    const char* seg = pos + 1;
+    const char* seg_end = std::find(seg, end, '/');
+    const size_t seg_len = seg_end - seg;
+
+    const Node* child = node.find_child(seg, seg_len);
+    if (child && find_in(*child, seg_end, end, method, captures, match)) {
+        return true;
+    }
+
+    if (seg_len > 0) {
+        for (int type = Node::PARAM_INT; type < Node::PARAM_TYPES; ++type) {
+            const Node* param = node.params[type].get();
+            if (!param || (type == Node::PARAM_INT && !is_digits(seg, seg_len))) {
+                continue;
+            }
+
+            captures.emplace_back(seg, seg_len);
+            if (find_in(*param, seg_end, end, method, captures, match)) {
+                return true;
+            }
+            captures.pop_back();
+        }
+    }
+
+    if (!node.rest.empty() && end - seg > 0) {
+        captures.emplace_back(seg, end - seg);
+        if (pick(node.rest, method, match)) {
+            return true;
+        }
+        captures.pop_back();
+    }
+
+    return pick_prefix(node, pos, end, method, match);
+}
+
+bool Router::find(StringView method, const char* path, size_t len, RouteMatch& match) const {
+    match.index = RouteMatch::NOT_FOUND;
+    match.method_not_allowed = false;
+    match.allowed_methods.clear();
+    match.captures.clear();
+    match.names = nullptr;
+
+    match.captures.emplace_back(path, len);
+    if (len > 0 && path[0] == '/' && find_in(*root_, path, path + len, method, match.captures, match)) {
+        match.method_not_allowed = false;
+        match.allowed_methods.clear();
+        return true;
+    }
+    match.captures.resize(1);
+
+    std::cmatch groups;
+    for (size_t route_id : regex_routes_) {
+        const Route& route = routes_[route_id];
+        if (!std::regex_search(path, path + len, groups, *route.regex)) {
+            continue;
+        }
+        if (!method_matches(route, method, match)) {
+            continue;
+        }
+
+        match.method_not_allowed = false;
+        match.allowed_methods.clear();
+        match.index = route.index;
+        match.names = &route.names;
+        match.captures.clear();
+        for (auto&& group : groups) {
+            match.captures.emplace_back(group.first, group.length());
+        }
+        return true;
+    }
+
+    return false;
+}
+
+} // namespace enji
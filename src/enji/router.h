@@ -0,0 +1,97 @@
+#pragma once
+
+#include <regex>
+#include "common.h"
+
+namespace enji {
+
+//
+// Result of routing one request path
+//
+struct RouteMatch {
+    static const size_t NOT_FOUND = size_t(-1);
+
+    // Index passed to Router::add for the matched route, or NOT_FOUND
+    size_t index = NOT_FOUND;
+
+    // Path matched some route, but none of them for this method
+    bool method_not_allowed = false;
+
+    // Methods of the routes the path matched, for the Allow header of 405.
+    // Views into the router
+    std::vector<StringView> allowed_methods;
+
+    // captures[0] is the whole path, the rest are parameters in pattern order.
+    // Views into the path passed to Router::find
+    std::vector<StringView> captures;
+
+    // Parameter names of the matched route, empty for regex routes
+    const std::vector<String>* names = nullptr;
+
+    bool found() const { return index != NOT_FOUND; }
+};
+
+//
+// Compiled router: a trie keyed by path segment for static segments
+// and typed `{param}` captures, regex as an explicit fallback.
+//
+// Pattern syntax:
+//   /api/view            exact path
+//   /gram/{id}           one segment captured as `id`
+//   /gram/{id:int}       one segment of digits
+//   /static/{path*}      the non-empty rest of the path, must be last
+//   ^/api                string prefix, `/apiview` too (literal regex anchor)
+//   ^/api/view$          exact path (literal regex anchors)
+//   ^/(\w+)\.png$        anything else starting with ^ is a std::regex
+//
+// Lookup prefers static segments over parameters over `{rest*}` over
+// prefixes, longest first, then tries regex routes in declaration order.
+// Among routes with the same pattern the first one declared for the method
+// wins.
+//
+class Router {
+public:
+    Router();
+    ~Router();
+
+    Router(Router&&);
+    Router& operator=(Router&&);
+
+    // Empty method matches any. Throws std::invalid_argument for bad patterns
+    void add(const String& method, const String& pattern, size_t index);
+
+    void clear();
+
+    // `path` must not include the query string
+    bool find(StringView method, const char* path, size_t len, RouteMatch& match) const;
+
+    size_t size() const { return routes_.size(); }
+
+private:
+    struct Node;
+
+    struct Route {
+        String method;
+        size_t index;
+        std::vector<String> names;
+        std::unique_ptr<std::regex> regex;
+    };
+
+    bool find_in(const Node& node, const char* pos, const char* end,
+        StringView method, std::vector<StringView>& captures,
+        RouteMatch& match) const;
+
+    bool pick(size_t route_id, StringView method, RouteMatch& match) const;
+    bool pick(const std::vector<size_t>& routes, StringView method, RouteMatch& match) const;
+
+    bool pick_prefix(const Node& node, const char* pos, const char* end,
+        StringView method, RouteMatch& match) const;
+
+    bool method_matches(const Route& route, StringView method, RouteMatch& match) const;
+
+    std::unique_ptr<Node> root_;
+    std::vector<Route> routes_;
+    std::vector<size_t> regex_routes_;
+};
+
+} // namespace enji
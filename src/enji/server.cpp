@@ -1,18 +1,81 @@
 #include "server.h"
 
+#include <cerrno>
+#include <chrono>
+
+#ifndef _WIN32
+#   include <csignal>
+#   include <sys/socket.h>
+#   include <unistd.h>
+#endif
+
+#ifdef __linux__
+#   include <sys/sendfile.h>
+#endif
+
 namespace enji {
 
 Config ServerConfig;
 
-ConnEvent::ConnEvent(Connection* conn, ConnEventType ev)
+std::ostream& operator << (std::ostream& out, const ConnHandle& handle) {
+    return out << handle.index << "." << handle.generation;
+}
+
+ConnHandle ConnectionTable::insert(ConnectionPtr conn) {
+    uint32_t index;
+    if (free_slots_.empty()) {
+        index = uint32_t(slots_.size());
+        slots_.emplace_back();
+    } else {
+        index = free_slots_.back();
+        free_slots_.pop_back();
+    }
+
+    Slot& slot = slots_[index];
+    slot.conn = std::move(conn);
+    ++size_;
+
+    ConnHandle handle;
+    handle.index = index;
+    handle.generation = slot.generation;
+    return handle;
+}
+
+bool ConnectionTable::contains(ConnHandle handle) const {
+    return handle.index < slots_.size() && slots_[handle.index].generation == handle.generation;
+}
+
+Connection* ConnectionTable::get(ConnHandle handle) const {
+    return contains(handle) ? slots_[handle.index].conn.get() : nullptr;
+}
+
+bool ConnectionTable::erase(ConnHandle handle) {
+    if (!contains(handle)) {
+        return false;
+    }
+    Slot& slot = slots_[handle.index];
+    slot.conn.reset();
+    ++slot.generation;
+    free_slots_.push_back(handle.index);
+    --size_;
+    return true;
+}
+
+ConnEvent::ConnEvent(ConnHandle conn, ConnEventType ev)
 :   conn(conn),
     ev(ev) {
 }
 
-ConnEvent::ConnEvent(Connection* conn, ConnEventType ev, TransferBlock buf)
+ConnEvent::ConnEvent(ConnHandle conn, ConnEventType ev, BufferRef&& buf)
 :   conn(conn),
     ev(ev),
-    buf(buf) {
+    buf(std::move(buf)) {
+}
+
+ConnEvent::ConnEvent(ConnHandle conn, FileRange&& file)
+:   conn(conn),
+    ev(ConnEventType::SENDFILE),
+    file(std::move(file)) {
 }
 
 Server::Server()
@@ -27,14 +90,14 @@ Server::Server(Config& config)
 Server::~Server() { }
 
 void cb_on_connection(uv_stream_t* stream, int status) {
-    Server& server = *reinterpret_cast<Server*>(stream->data);
-    server.on_connection(status);
+    EventLoop& loop = *reinterpret_cast<EventLoop*>(stream->data);
+    loop.parent_->on_connection(loop, status);
 }
 
 void cb_close(uv_handle_t* handle) {
     Connection& req = *reinterpret_cast<Connection*>(handle->data);
     req.notify_closed();
-    delete handle;
+    delete reinterpret_cast<uv_tcp_t*>(handle);
 }
 
 void cb_after_write(uv_write_t* write, int status) {
@@ -42,14 +105,51 @@ void cb_after_write(uv_write_t* write, int status) {
     req.on_after_write(write, status);
 }
 
-void cb_after_shutdown(uv_shutdown_t* shutdown, int status) {
-    Connection& req = *reinterpret_cast<Connection*>(shutdown->data);
-    req.on_after_shutdown(shutdown, status);
+void cb_poll_writable(uv_poll_t* poll, int status, int events) {
+    Connection& req = *reinterpret_cast<Connection*>(poll->data);
+    req.on_poll_writable(status);
+}
+
+void cb_sendfile_work(uv_work_t* req) {
+#ifdef __linux__
+    auto work = reinterpret_cast<SendfileWork*>(req->data);
+    const size_t max_chunk = 1 << 30;
+    while (work->sent < work->length) {
+        off_t offset = off_t(work->offset + work->sent);
+        const ssize_t sent = ::sendfile(work->sock, work->file->fd(), &offset, std::min(work->length - work->sent, max_chunk));
+        if (sent > 0) {
+            work->sent += size_t(sent);
+        } else if (sent == 0) {
+            work->error = EPIPE;
+            break;
+        } else if (errno != EINTR) {
+            work->error = errno;
+            break;
+        }
+    }
+#endif
+}
+
+void cb_after_sendfile(uv_work_t* req, int status) {
+    std::unique_ptr<SendfileWork> work{reinterpret_cast<SendfileWork*>(req->data)};
+    work->conn->on_after_sendfile(work.get());
+}
+
+void cb_after_file_read(uv_fs_t* req) {
+    std::unique_ptr<FileRead> read{reinterpret_cast<FileRead*>(req->data)};
+    read->conn->on_after_file_read(read.get());
+    uv_fs_req_cleanup(req);
 }
 
 void cb_alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-    buf->base = new char[suggested_size];
-    buf->len = size_t(suggested_size);
+    Connection& req = *reinterpret_cast<Connection*>(handle->data);
+    BufferPool& pool = req.event_loop()->read_buffers();
+    //
+    // Block starts with room for BufferStorage, so read data is shared
+    // without another allocation
+    //
+    buf->base = pool.acquire() + BufferStorage::HEADER_SIZE;
+    buf->len = pool.block_size() - BufferStorage::HEADER_SIZE;
 }
 
 void cb_after_read(uv_stream_t* handle, ssize_t nread, const uv_buf_t* buf) {
@@ -65,51 +165,64 @@ void Server::setup(Config& config) {
     UVCHECK(uv_ip4_addr("127.0.0.1", config["port"].integer(), &addr),
         std::runtime_error, "Can't parse address to socketaddr");
 
-    auto tcp_server = new uv_tcp_t;
-    tcp_server_.reset(tcp_server);
-
-    event_loop_.reset(new EventLoop{ reinterpret_cast<uv_stream_t*>(tcp_server) });
-
-    UVCHECK(uv_tcp_init(event_loop_->loop(), tcp_server),
-        std::runtime_error, "Can't init tcp");
-
-    tcp_server->data = this;
-    UVCHECK(uv_tcp_bind(tcp_server, (const struct sockaddr*) &addr, 0),
-        std::runtime_error, "Can't bind tcp port");
+    int loops_count = config.integer("event_loops", 1);
+#ifdef _WIN32
+    //
+    // Listening socket can't be shared between loops here, so only one loop
+    //
+    loops_count = 1;
+#endif
+    if (loops_count < 1) {
+        loops_count = 1;
+    }
 
-    UVCHECK(uv_listen((uv_stream_t*)tcp_server, SOMAXCONN, cb_on_connection),
-        std::runtime_error, "Can't listen tcp port");
+    event_loops_.clear();
+    for (int i = 0; i < loops_count; ++i) {
+        event_loops_.emplace_back(new EventLoop{this, size_t(i), config});
+        event_loops_.back()->listen((const struct sockaddr*) &addr,
+            i == 0 ? nullptr : event_loops_.front().get());
+    }
 }
 
-void cb_idle(uv_idle_t* handle);
-
 void Server::run() {
-    uv_idle_t* on_loop = new uv_idle_t;
-    UVCHECK(uv_idle_init(event_loop_->loop(), on_loop),
-        std::runtime_error, "Can't init loop events handling");
-    on_loop->data = this;
-    on_loop_.reset(on_loop, [](uv_idle_t* idle) { uv_idle_stop(idle); delete idle; });
-    uv_idle_start(on_loop, cb_idle);
+#ifndef _WIN32
+    //
+    // Peer resets show up as EPIPE from writes and sendfile instead of
+    // killing the process
+    //
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    const int worker_threads = config_.integer("worker_threads", 0);
+    if (worker_threads > 0) {
+        workers_.reset(new WorkerPool{size_t(worker_threads),
+            size_t(config_.integer("queue_capacity", 16384))});
+        workers_->on_room([this]() {
+            for (auto&& event_loop : event_loops_) {
+                event_loop->wakeup();
+            }
+        });
+        workers_->start([](ConnectionPtr& conn) {
+            conn->drain_input();
+        });
+    }
 
-    threads_.push_back(std::thread{[](decltype(input_queue_) & input_queue) {
-        ConnEvent msg;
-        while (true) {
+    for (size_t i = 1; i < event_loops_.size(); ++i) {
+        loop_threads_.push_back(std::thread{[](EventLoop* event_loop) {
             try {
-                if (input_queue.pop(msg)) {
-                    msg.conn->handle_input(TransferBlock{msg.buf.data, size_t(msg.buf.size)});
-                    msg.buf.free();
-                }
+                event_loop->run();
             }
             catch (std::exception& e) {
-                std::cerr << "Exception in worker: " << e.what() << std::endl;
-            }
-            catch (...) {
-                std::cerr << "Unknown exception in worker thread" << std::endl;
+                std::cerr << "Exception in event loop " << event_loop->index() << ": " << e.what() << std::endl;
             }
-        }
-    }, std::ref(input_queue_)});
+        }, event_loops_[i].get()});
+    }
+
+    event_loops_.front()->run();
 
-    event_loop_->run();
+    for (auto&& loop_thread : loop_threads_) {
+        loop_thread.join();
+    }
 }
 
 Server& Server::create_connection(std::function<std::shared_ptr<Connection>()> create) {
@@ -117,58 +230,271 @@ Server& Server::create_connection(std::function<std::shared_ptr<Connection>()> c
     return *this;
 }
 
-void Server::on_connection(int status) {
+EventLoop* Server::event_loop() {
+    auto current = EventLoop::current();
+    if (current && current->parent_ == this) {
+        return current;
+    }
+    return event_loops_.front().get();
+}
+
+void Server::on_connection(EventLoop& loop, int status) {
     auto new_connection = create_connection_();
+    new_connection->id_ = loop.connections_.insert(new_connection);
     new_connection->accept();
-    connections_.push_back(new_connection);
-}
-
-void Server::on_loop() {
-    ConnEvent msg;
-    while (output_queue_.pop(msg)) {
-        if (msg.ev == ConnEventType::WRITE || msg.ev == ConnEventType::CLOSE) {
-            auto wr = new WriteContext{};
-            wr->conn = msg.conn;
-            msg.buf.to_uv_buf(&wr->buf);
-            wr->req.data = wr->conn;
-            if (msg.ev == ConnEventType::CLOSE) {
-                wr->close = true;
-            }
-            UVCHECK(uv_write(&wr->req, msg.conn->sock(), &wr->buf, 1, cb_after_write),
-                std::runtime_error, "Can't write data");
-        } else if (msg.ev == ConnEventType::CLOSE_CONFIRMED) {
-            Connection* remove_conn = msg.conn;
-            auto found = std::find_if(connections_.begin(), connections_.end(),
-                [remove_conn](std::shared_ptr<Connection> req) {
-                    return req.get() == remove_conn; });
-            connections_.erase(found);
+}
+
+void Server::on_loop(EventLoop& loop) {
+    if (!loop.stalled_.empty()) {
+        push_stalled(loop);
+    }
+
+    const size_t batch_size = 64;
+    ConnEvent batch[batch_size];
+    size_t popped;
+    while ((popped = loop.output_queue_.pop_batch(batch, batch_size)) > 0) {
+        for (size_t i = 0; i < popped; ++i) {
+            on_loop_event(loop, batch[i]);
         }
     }
+
+    for (auto conn : loop.pending_flush_) {
+        conn->flush_writes();
+    }
+    loop.pending_flush_.clear();
 }
 
-void Server::queue_read(Connection* conn, TransferBlock block) {
-    if (config_["worker_threads"].integer() == 0) {
-        conn->handle_input(block);
-        block.free();
+void Server::on_loop_event(EventLoop& loop, ConnEvent& msg) {
+    Connection* conn = loop.connections_.get(msg.conn);
+    if (!conn || !conn->sock() || uv_is_closing(reinterpret_cast<uv_handle_t*>(conn->sock()))) {
+        //
+        // Event for a connection that is already closing or gone
+        //
+        return;
+    }
+
+    if (msg.ev == ConnEventType::NONE) {
+        return;
+    }
+
+    if (msg.ev == ConnEventType::RESUME) {
+        if (!workers_) {
+            conn->handle_resume();
+        } else if (conn->post_resume()) {
+            schedule_input(conn);
+        }
+        return;
+    }
+
+    if (msg.ev == ConnEventType::SENDFILE) {
+        conn->backlog_.push_back(OutputSegment{BufferRef{}, std::move(msg.file)});
+    } else if (!conn->backlog_.empty()) {
+        // Behind a file still being sent
+        if (!msg.buf.empty()) {
+            conn->backlog_.push_back(OutputSegment{std::move(msg.buf), FileRange{}});
+        }
     } else {
-        input_queue_.push(ConnEvent{conn, ConnEventType::READ, block});
+        conn->pending_writes_.append(std::move(msg.buf));
     }
+
+    if (msg.ev == ConnEventType::CLOSE) {
+        conn->pending_close_ = true;
+    }
+    if (!conn->pending_flush_) {
+        conn->pending_flush_ = true;
+        loop.pending_flush_.push_back(conn);
+    }
+}
+
+void Server::on_close_confirmed(EventLoop& loop, Connection* conn) {
+    loop.connections_.erase(conn->id_);
 }
 
-void Server::queue_write(Connection* conn, TransferBlock block) {
-    output_queue_.push(ConnEvent{conn, ConnEventType::WRITE, block});
+void Server::queue_read(Connection* conn, BufferRef&& data) {
+    if (!workers_) {
+        conn->consume_input(data);
+    } else if (conn->post_input(std::move(data))) {
+        schedule_input(conn);
+    }
+}
+
+void Server::schedule_input(Connection* conn) {
+    ConnectionPtr scheduled = conn->shared_from_this();
+    if (!workers_->try_push(std::move(scheduled))) {
+        //
+        // Workers are behind. Waiting for them here would also stop
+        // the writes they may be blocked on, so the connection stops
+        // reading and waits for a free slot instead
+        //
+        EventLoop& loop = *conn->event_loop();
+        conn->input_stalled_ = true;
+        conn->pause_reading();
+        loop.stalled_.push_back(std::move(scheduled));
+        push_stalled(loop);
+    }
+}
+
+void Server::push_stalled(EventLoop& loop) {
+    while (!loop.stalled_.empty()) {
+        //
+        // Asked before trying, so a worker taking work right after a
+        // failed try still wakes the loop
+        //
+        workers_->want_room();
+        Connection* conn = loop.stalled_.front().get();
+        if (!workers_->try_push(std::move(loop.stalled_.front()))) {
+            return;
+        }
+        loop.stalled_.pop_front();
+
+        conn->input_stalled_ = false;
+        if (!conn->write_blocked_.load() && conn->backlog_.empty()) {
+            conn->resume_reading();
+        }
+    }
+}
+
+void Server::queue_write(Connection* conn, BufferRef&& data) {
+    conn->event_loop()->push(ConnEvent{conn->id(), ConnEventType::WRITE, std::move(data)});
+}
+
+void Server::queue_file(Connection* conn, FileRange&& file) {
+    conn->event_loop()->push(ConnEvent{conn->id(), std::move(file)});
 }
 
 void Server::queue_close(Connection* conn) {
-    output_queue_.push(ConnEvent{conn, ConnEventType::CLOSE});
+    conn->event_loop()->push(ConnEvent{conn->id(), ConnEventType::CLOSE});
+}
+
+void Server::queue_resume(Connection* conn) {
+    conn->event_loop()->push(ConnEvent{conn->id(), ConnEventType::RESUME});
+}
+
+WorkerPool::WorkerPool(size_t workers, size_t queue_capacity) {
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.emplace_back(new Worker{queue_capacity});
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
 }
 
-void Server::queue_confirmed_close(Connection* conn) {
-    output_queue_.push(ConnEvent{conn, ConnEventType::CLOSE_CONFIRMED});
+void WorkerPool::start(Handler&& handler) {
+    handler_ = std::move(handler);
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i]->thread = std::thread{&WorkerPool::work, this, i};
+    }
 }
 
-EventLoop::EventLoop(uv_stream_t* server)
-:   server_{server} {
+void WorkerPool::stop() {
+    {
+        std::lock_guard<std::mutex> guard{park_mutex_};
+        stopped_.store(true);
+    }
+    park_cond_.notify_all();
+
+    for (auto&& worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+bool WorkerPool::try_push(ConnectionPtr&& conn) {
+    const size_t start = next_worker_.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        auto&& worker = workers_[(start + i) % workers_.size()];
+        if (worker->queue.try_push(std::move(conn))) {
+            pending_.fetch_add(1);
+            if (sleeping_.load() > 0) {
+                std::lock_guard<std::mutex> guard{park_mutex_};
+                park_cond_.notify_one();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t WorkerPool::take(size_t index, ConnectionPtr* conns, size_t max_count) {
+    size_t taken = workers_[index]->queue.pop_batch(conns, max_count);
+
+    //
+    // Own queue is empty: steal a single connection from the others
+    //
+    for (size_t i = 1; taken == 0 && i < workers_.size(); ++i) {
+        taken = workers_[(index + i) % workers_.size()]->queue.pop_batch(conns, 1);
+    }
+
+    if (taken) {
+        pending_.fetch_sub(taken);
+        if (room_wanted_.load() && room_wanted_.exchange(false) && room_handler_) {
+            room_handler_();
+        }
+    }
+    return taken;
+}
+
+void WorkerPool::park() {
+    std::unique_lock<std::mutex> lock{park_mutex_};
+    sleeping_.fetch_add(1);
+    park_cond_.wait(lock, [this] { return pending_.load() > 0 || stopped_.load(); });
+    sleeping_.fetch_sub(1);
+}
+
+void WorkerPool::work(size_t index) {
+    const size_t batch_size = 16;
+    const size_t spins_before_park = 64;
+    ConnectionPtr batch[batch_size];
+    size_t idle_spins = 0;
+
+    while (!stopped_.load()) {
+        const size_t taken = take(index, batch, batch_size);
+        if (taken == 0) {
+            if (++idle_spins < spins_before_park) {
+                std::this_thread::yield();
+            } else {
+                idle_spins = 0;
+                park();
+            }
+            continue;
+        }
+
+        idle_spins = 0;
+        for (size_t i = 0; i < taken; ++i) {
+            try {
+                handler_(batch[i]);
+                batch[i].reset();
+            }
+            catch (std::exception& e) {
+                std::cerr << "Exception in worker: " << e.what() << std::endl;
+            }
+            catch (...) {
+                std::cerr << "Unknown exception in worker thread" << std::endl;
+            }
+        }
+    }
+}
+
+namespace {
+    thread_local EventLoop* current_event_loop = nullptr;
+}
+
+void cb_wakeup(uv_async_t* handle);
+
+EventLoop::EventLoop(Server* parent, size_t index, const Config& config)
+:   parent_{parent},
+    index_{index},
+    output_queue_{size_t(config.integer("queue_capacity", 16384))},
+    read_buffers_{size_t(config.integer("read_buffer_size", 64 * 1024)),
+        size_t(config.integer("read_buffer_pool_blocks", 256))},
+    write_high_watermark_{size_t(config.integer("write_high_watermark", 1024 * 1024))},
+    write_low_watermark_{size_t(config.integer("write_low_watermark", 256 * 1024))} {
+    if (write_low_watermark_ > write_high_watermark_) {
+        write_low_watermark_ = write_high_watermark_;
+    }
+
     uv_loop_t* loop = new uv_loop_t;
     UVCHECK(uv_loop_init(loop),
         std::runtime_error, "Can't init event loop");
@@ -176,27 +502,136 @@ EventLoop::EventLoop(uv_stream_t* server)
         uv_loop_close(loop);
         delete loop;
     });
-}
 
-EventLoop::EventLoop(uv_stream_t* server, uv_loop_t* loop)
-:   server_{server} {
-    loop_.reset(loop, [](uv_loop_t* loop) {
-        uv_loop_close(loop);
-        delete loop;
+    uv_async_t* on_loop = new uv_async_t;
+    UVCHECK(uv_async_init(loop, on_loop, cb_wakeup),
+        std::runtime_error, "Can't init loop events handling");
+    on_loop->data = this;
+    on_loop_.reset(on_loop, [](uv_async_t* async) {
+        uv_close(reinterpret_cast<uv_handle_t*>(async), [](uv_handle_t* handle) {
+            delete reinterpret_cast<uv_async_t*>(handle); });
+    });
+
+    uv_timer_t* clock = new uv_timer_t;
+    UVCHECK(uv_timer_init(loop, clock),
+        std::runtime_error, "Can't init loop clock");
+    clock->data = this;
+    clock_.reset(clock, [](uv_timer_t* timer) {
+        uv_close(reinterpret_cast<uv_handle_t*>(timer), [](uv_handle_t* handle) {
+            delete reinterpret_cast<uv_timer_t*>(handle); });
     });
 }
 
+void EventLoop::listen(const sockaddr* addr, EventLoop* shared_from) {
+    auto tcp_server = new uv_tcp_t;
+    tcp_server_.reset(tcp_server);
+
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    //
+    // Every loop binds its own socket to the same port and kernel balances
+    // incoming connections between them
+    //
+    shared_from = nullptr;
+
+    UVCHECK(uv_tcp_init_ex(loop(), tcp_server, addr->sa_family),
+        std::runtime_error, "Can't init tcp");
+
+    uv_os_fd_t fd;
+    UVCHECK(uv_fileno(reinterpret_cast<uv_handle_t*>(tcp_server), &fd),
+        std::runtime_error, "Can't get tcp socket descriptor");
+
+    int on = 1;
+    UVCHECK(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0 ? 0 : -errno,
+        std::runtime_error, "Can't set SO_REUSEPORT");
+#else
+    UVCHECK(uv_tcp_init(loop(), tcp_server),
+        std::runtime_error, "Can't init tcp");
+#endif
+
+    tcp_server->data = this;
+
+#ifndef _WIN32
+    if (shared_from) {
+        //
+        // No port reuse balancing: loops accept from one shared listening socket
+        //
+        uv_os_fd_t shared_fd;
+        UVCHECK(uv_fileno(reinterpret_cast<uv_handle_t*>(shared_from->tcp_server_.get()), &shared_fd),
+            std::runtime_error, "Can't get shared tcp socket descriptor");
+        UVCHECK(uv_tcp_open(tcp_server, dup(shared_fd)),
+            std::runtime_error, "Can't open shared tcp socket");
+    } else
+#endif
+    {
+        UVCHECK(uv_tcp_bind(tcp_server, addr, 0),
+            std::runtime_error, "Can't bind tcp port");
+    }
+
+    UVCHECK(uv_listen(server(), SOMAXCONN, cb_on_connection),
+        std::runtime_error, "Can't listen tcp port");
+}
+
+void cb_clock(uv_timer_t* timer) {
+    update_http_clock();
+}
+
 void EventLoop::run() {
+    current_event_loop = this;
+
+    //
+    // First tick lands right after the next second starts, so Date lags
+    // the wall clock by milliseconds. Doesn't keep the loop alive
+    //
+    update_http_clock();
+    const auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+    const auto into_second = std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count() % 1000;
+    uv_timer_start(~clock_, cb_clock, uint64_t(1000 - into_second), 1000);
+    uv_unref(reinterpret_cast<uv_handle_t*>(~clock_));
+
     UVCHECK(uv_run(loop(), UV_RUN_DEFAULT),
         std::runtime_error, "Can't run event loop");
 }
 
-Connection::Connection(Server* parent, size_t id)
+EventLoop* EventLoop::current() {
+    return current_event_loop;
+}
+
+void EventLoop::wakeup() {
+    //
+    // Producers pushing a batch of events signal the loop only once:
+    // flag is reset by the loop right before it drains the queue
+    //
+    if (!wakeup_pending_.exchange(true)) {
+        uv_async_send(~on_loop_);
+    }
+}
+
+void EventLoop::release_read_buffer(char* block) {
+    if (current() == this) {
+        read_buffers_.release_local(block);
+    } else {
+        read_buffers_.release(block);
+    }
+}
+
+void EventLoop::push(ConnEvent&& event) {
+    while (!output_queue_.try_push(std::move(event))) {
+        if (current() == this) {
+            parent_->on_loop(*this);
+        } else {
+            wakeup();
+            std::this_thread::yield();
+        }
+    }
+    wakeup();
+}
+
+Connection::Connection(Server* parent)
 :   base_parent_{parent},
-    id_{id} {
+    event_loop_{parent->event_loop()} {
     uv_tcp_t* stream = new uv_tcp_t{};
     stream_.reset(reinterpret_cast<uv_stream_t*>(stream));
-    UVCHECK(uv_tcp_init(base_parent_->event_loop()->loop(), stream),
+    UVCHECK(uv_tcp_init(event_loop_->loop(), stream),
         std::runtime_error, "Can't init tcp in Connection");
     stream->data = this;
 }
@@ -207,7 +642,7 @@ std::ostream& Connection::log() {
 }
 
 void Connection::accept() {
-    UVCHECK(uv_accept(base_parent_->event_loop()->server(), stream_.get()),
+    UVCHECK(uv_accept(event_loop_->server(), stream_.get()),
         std::runtime_error, "Can't accept socket");
 
     tp_accepted_ = std::chrono::high_resolution_clock::now();
@@ -216,28 +651,93 @@ void Connection::accept() {
         std::runtime_error, "Can't start read");
 }
 
-void cb_idle(uv_idle_t* handle) {
-    Server& that = *reinterpret_cast<Server*>(handle->data);
-    that.on_loop();
+void cb_wakeup(uv_async_t* handle) {
+    EventLoop& loop = *reinterpret_cast<EventLoop*>(handle->data);
+    loop.wakeup_pending_.store(false);
+    loop.parent_->on_loop(loop);
 }
 
-void on_work_cb(uv_work_t* req) {
+bool Connection::post_input(BufferRef&& data) {
+    std::lock_guard<std::mutex> guard{inbox_mutex_};
+    inbox_.emplace_back(std::move(data));
+    if (inbox_scheduled_) {
+        return false;
+    }
+    inbox_scheduled_ = true;
+    return true;
+}
 
+bool Connection::post_resume() {
+    std::lock_guard<std::mutex> guard{inbox_mutex_};
+    resume_pending_ = true;
+    if (inbox_scheduled_) {
+        return false;
+    }
+    inbox_scheduled_ = true;
+    return true;
 }
 
-void on_after_work_cb(uv_work_t* req, int status) {
+void Connection::drain_input() {
+    while (true) {
+        BufferRef data;
+        bool resume = false;
+        {
+            std::lock_guard<std::mutex> guard{inbox_mutex_};
+            if (resume_pending_) {
+                resume_pending_ = false;
+                resume = true;
+            } else if (inbox_.empty()) {
+                inbox_scheduled_ = false;
+                return;
+            } else {
+                data = std::move(inbox_.front());
+                inbox_.pop_front();
+            }
+        }
 
+        try {
+            if (resume) {
+                handle_resume();
+            } else {
+                consume_input(data);
+            }
+        }
+        catch (std::exception& e) {
+            std::cerr << "Exception in connection handler: " << e.what() << std::endl;
+        }
+        catch (...) {
+            std::cerr << "Unknown exception in connection handler" << std::endl;
+        }
+    }
+}
+
+void Connection::consume_input(const BufferRef& data) {
+    if (data.empty()) {
+        handle_input_end();
+    } else {
+        handle_input(data);
+    }
+}
+
+void Connection::handle_input_end() {
+    close();
+}
+
+void release_read_block(BufferStorage* storage) {
+    EventLoop* loop = reinterpret_cast<EventLoop*>(storage->context);
+    storage->~BufferStorage();
+    loop->release_read_buffer(reinterpret_cast<char*>(storage));
 }
 
 void Connection::on_after_read(ssize_t nread, const uv_buf_t* buf) {
     if (nread > 0) {
-        //std::cout << String(buf->base, buf->base + nread);
-        uv_buf_t send_buf = uv_buf_init(buf->base, (unsigned int)nread);
-        base_parent_->queue_read(this, TransferBlock{ buf->base, size_t(nread) });
+        char* block = buf->base - BufferStorage::HEADER_SIZE;
+        auto storage = BufferStorage::init(block, release_read_block, event_loop_);
+        base_parent_->queue_read(this, BufferRef::adopt(storage, buf->base, size_t(nread)));
     }
 
-    if (nread <= 0) {
-        delete[] buf->base;
+    if (nread <= 0 && buf->base) {
+        event_loop_->read_buffers().release_local(buf->base - BufferStorage::HEADER_SIZE);
     }
 
     if (nread == 0) {
@@ -245,68 +745,441 @@ void Connection::on_after_read(ssize_t nread, const uv_buf_t* buf) {
     }
 
     if (nread < 0) {
+        if (uv_is_closing(reinterpret_cast<uv_handle_t*>(stream_.get())) || read_eof_) {
+            return;
+        }
+
+        if (nread != UV_EOF) {
+            close_handle();
+            return;
+        }
+
+        //
+        // Peer is done sending, but requests may still wait in the inbox
+        // or on a worker. End of input goes the way reads go, so the close
+        // it leads to is queued behind their responses
+        //
+        read_eof_ = true;
+        uv_read_stop(stream_.get());
+        base_parent_->queue_read(this, BufferRef{});
+    }
+}
+
+void Connection::flush_writes() {
+    pending_flush_ = false;
+
+    auto handle = reinterpret_cast<uv_handle_t*>(stream_.get());
+    if (!handle || uv_is_closing(handle)) {
+        pending_writes_.clear();
+        backlog_.clear();
+        return;
+    }
+
+    if (write_pending()) {
+        send_backlog();
+    }
+}
+
+bool Connection::write_pending() {
+    auto& pending = pending_writes_.bufs();
+    std::vector<uv_buf_t> bufs(pending.size());
+    for (size_t i = 0; i < pending.size(); ++i) {
+        pending[i].to_uv_buf(&bufs[i]);
+    }
+
+    //
+    // Synchronous attempt first: most responses fit into the socket buffer
+    //
+    size_t sent_bufs = 0;
+    if (!bufs.empty()) {
+        int written = uv_try_write(stream_.get(), bufs.data(), unsigned(bufs.size()));
+        if (written < 0 && written != UV_EAGAIN) {
+            pending_writes_.clear();
+            close_handle();
+            return false;
+        }
+
+        size_t left = written > 0 ? size_t(written) : 0;
+        release_written(left);
+        while (sent_bufs < bufs.size() && left >= bufs[sent_bufs].len) {
+            left -= bufs[sent_bufs].len;
+            ++sent_bufs;
+        }
+        if (left) {
+            bufs[sent_bufs].base += left;
+            bufs[sent_bufs].len -= left;
+        }
+    }
+
+    if (sent_bufs == bufs.size()) {
+        pending_writes_.clear();
+        return true;
+    }
+
+    auto wr = new WriteContext{};
+    wr->conn = this;
+    wr->req.data = this;
+    wr->bufs.assign(bufs.begin() + sent_bufs, bufs.end());
+    for (auto&& buf : wr->bufs) {
+        wr->bytes += buf.len;
+    }
+    wr->data = std::move(pending_writes_);
+    pending_writes_.clear();
+
+    const int status = uv_write(&wr->req, stream_.get(), wr->bufs.data(), unsigned(wr->bufs.size()), cb_after_write);
+    if (status != 0) {
+        delete wr;
+        close_handle();
+        return false;
+    }
+    ++writes_in_flight_;
+
+    if (!reading_paused_ && queued_bytes_.load() >= event_loop_->write_high_watermark()) {
+        //
+        // Peer doesn't keep up: stop reading (and producing responses)
+        // until our queue drains
+        //
+        write_blocked_.store(true);
+        reading_paused_ = true;
+        uv_read_stop(stream_.get());
+    }
+    return true;
+}
+
+void Connection::send_backlog() {
+    auto handle = reinterpret_cast<uv_handle_t*>(stream_.get());
+    if (!handle || uv_is_closing(handle)) {
+        backlog_.clear();
+        return;
+    }
+
+    while (!backlog_.empty()) {
+        if (!backlog_.front().is_file()) {
+            while (!backlog_.empty() && !backlog_.front().is_file()) {
+                pending_writes_.append(std::move(backlog_.front().buf));
+                backlog_.pop_front();
+            }
+            if (!write_pending()) {
+                return;
+            }
+            continue;
+        }
+
+        if (!send_file(backlog_.front().file)) {
+            // Waiting for the disk or the socket, or closed
+            return;
+        }
+        backlog_.pop_front();
+    }
+
+    if (pending_close_ && writes_in_flight_ == 0) {
+        close_handle();
+        return;
+    }
+
+    if (!write_blocked_.load()) {
+        resume_reading();
+    }
+}
+
+void Connection::pause_reading() {
+    //
+    // Don't take more requests while the client doesn't read
+    //
+    if (!reading_paused_) {
+        reading_paused_ = true;
+        uv_read_stop(stream_.get());
+    }
+}
+
+void Connection::resume_reading() {
+    auto handle = reinterpret_cast<uv_handle_t*>(stream_.get());
+    if (reading_paused_ && !read_eof_ && !input_stalled_ && handle && !uv_is_closing(handle)) {
+        reading_paused_ = false;
+        uv_read_start(stream_.get(), cb_alloc_buffer, cb_after_read);
+    }
+}
+
+bool Connection::send_file(FileRange& file) {
+    if (file_busy_) {
+        return false;
+    }
+#ifdef __linux__
+    if (file.length > 0 && !sendfile_unsupported_) {
         //
-        // FIXME: Write properly status == UV_EOF
+        // sendfile goes straight to the socket: it waits until libuv has
+        // nothing of ours left in its write queue. The call runs on the
+        // threadpool, reading a cold file must not stall the loop
         //
+        if (writes_in_flight_ > 0) {
+            return false;
+        }
+
+        if (sock_dup_ < 0) {
+            uv_os_fd_t sock;
+            if (uv_fileno(reinterpret_cast<uv_handle_t*>(stream_.get()), &sock) != 0
+                    || (sock_dup_ = ::dup(sock)) < 0) {
+                close_handle();
+                return false;
+            }
+        }
+
+        auto work = new SendfileWork{};
+        work->req.data = work;
+        work->conn = shared_from_this();
+        work->sock = sock_dup_;
+        work->file = file.file;
+        work->offset = file.offset;
+        work->length = file.length;
+        if (uv_queue_work(event_loop_->loop(), &work->req, cb_sendfile_work, cb_after_sendfile) != 0) {
+            delete work;
+            close_handle();
+            return false;
+        }
+        file_busy_ = true;
+        return false;
+    }
+#endif
+    return read_file(file);
+}
+
+bool Connection::read_file(FileRange& file) {
+    const size_t block_size = 64 * 1024;
+
+    //
+    // Read-ahead: the next block is read while up to two earlier ones
+    // are being written. libuv keeps the writes in order
+    //
+    if (file.length > 0 && writes_in_flight_ < 2) {
+        auto read = new FileRead{};
+        read->req.data = read;
+        read->conn = shared_from_this();
+        read->file = file.file;
+        read->block = BufferRef::allocate(std::min(file.length, block_size));
+
+        uv_buf_t buf = uv_buf_init(read->block.mutable_data(), static_cast<unsigned int>(read->block.size()));
+        if (uv_fs_read(event_loop_->loop(), &read->req, file.file->fd(), &buf, 1, file.offset, cb_after_file_read) != 0) {
+            delete read;
+            close_handle();
+            return false;
+        }
+        file.offset += read->block.size();
+        file.length -= read->block.size();
+        file_busy_ = true;
+        return false;
+    }
 
-        auto shutdown = new uv_shutdown_t;
-        shutdown->data = this;
-        UVCHECK(uv_shutdown(shutdown, stream_.get(), cb_after_shutdown),
-            std::runtime_error, "Can't start connection shutdown");
+    if (file.length > 0) {
+        pause_reading();
+        return false;
     }
+    return true;
+}
+
+void Connection::on_after_sendfile(SendfileWork* work) {
+    file_busy_ = false;
+
+    auto handle = reinterpret_cast<uv_handle_t*>(stream_.get());
+    if (!handle || uv_is_closing(handle)) {
+        close_file_io();
+        return;
+    }
+
+    FileRange& file = backlog_.front().file;
+    file.offset += work->sent;
+    file.length -= work->sent;
+
+    if (work->error == EAGAIN || work->error == EWOULDBLOCK) {
+        poll_writable();
+        return;
+    }
+    if (work->error == EINVAL || work->error == ENOSYS) {
+        // Filesystem without sendfile support
+        sendfile_unsupported_ = true;
+    } else if (work->error != 0) {
+        //
+        // Socket error, or the file got shorter than the Content-length
+        // already sent: the response can't be completed
+        //
+        close_handle();
+        return;
+    }
+    send_backlog();
+}
+
+void Connection::on_after_file_read(FileRead* read) {
+    file_busy_ = false;
+
+    auto handle = reinterpret_cast<uv_handle_t*>(stream_.get());
+    if (!handle || uv_is_closing(handle)) {
+        return;
+    }
+
+    const ssize_t result = read->req.result;
+    if (result <= 0) {
+        close_handle();
+        return;
+    }
+
+    queued_bytes_.fetch_add(size_t(result));
+    pending_writes_.append(read->block.slice(0, size_t(result)));
+    if (write_pending()) {
+        send_backlog();
+    }
+}
+
+void Connection::poll_writable() {
+#ifdef __linux__
+    if (!poll_) {
+        //
+        // The socket fd is already registered with the loop by uv_tcp_t,
+        // the poll handle watches the dup
+        //
+        poll_ = new uv_poll_t;
+        if (uv_poll_init(event_loop_->loop(), poll_, sock_dup_) != 0) {
+            delete poll_;
+            poll_ = nullptr;
+            close_handle();
+            return;
+        }
+        poll_->data = this;
+    }
+
+    uv_poll_start(poll_, UV_WRITABLE, cb_poll_writable);
+    pause_reading();
+#endif
+}
+
+void Connection::on_poll_writable(int status) {
+    uv_poll_stop(poll_);
+    if (status < 0) {
+        close_handle();
+        return;
+    }
+    send_backlog();
+}
+
+void Connection::close_file_io() {
+#ifdef __linux__
+    if (poll_) {
+        uv_poll_stop(poll_);
+        uv_close(reinterpret_cast<uv_handle_t*>(poll_), [](uv_handle_t* handle) {
+            delete reinterpret_cast<uv_poll_t*>(handle);
+        });
+        poll_ = nullptr;
+    }
+
+    //
+    // A sendfile on the threadpool may still use the dup, it's closed
+    // once that one is back
+    //
+    if (sock_dup_ >= 0 && !file_busy_) {
+        ::close(sock_dup_);
+        sock_dup_ = -1;
+    }
+#endif
+}
+
+void Connection::release_written(size_t bytes) {
+    const size_t queued = queued_bytes_.fetch_sub(bytes) - bytes;
+    if (queued > event_loop_->write_low_watermark() || !write_blocked_.exchange(false)) {
+        return;
+    }
+
+    resume_reading();
+
+    {
+        std::lock_guard<std::mutex> guard{writable_mutex_};
+    }
+    writable_cond_.notify_all();
+
+    on_writable();
 }
 
 void Connection::on_after_write(uv_write_t* req, int status) {
     auto write_result = reinterpret_cast<WriteContext*>(req);
     req->handle->data = write_result->conn;
 
-    UVCHECK(status,
-        std::runtime_error, "Bad status of write operation");
+    --writes_in_flight_;
+    release_written(write_result->bytes);
 
     //
-    // FIXME: Write properly status == 0, UV_ECANCELED, error
+    // Failed write (reset by peer, canceled by close) ends the connection too
     //
-
-    if (write_result->close) {
-        uv_close((uv_handle_t*) req->handle, cb_close);
+    if (status < 0) {
+        close_handle();
+    } else {
+        send_backlog();
     }
 
-    delete[] write_result->buf.base;
     delete write_result;
 }
 
-void Connection::on_after_shutdown(uv_shutdown_t* shutdown, int status) {
-    UVCHECK(status,
-        std::runtime_error, "Bad status of shutdown operation");
-    //
-    // FIXME: Write properly status < 0
-    //
+void Connection::close_handle() {
+    close_file_io();
 
-    uv_close((uv_handle_t*) shutdown->handle, cb_close);
-    delete shutdown;
+    auto handle = reinterpret_cast<uv_handle_t*>(stream_.get());
+    if (handle && !uv_is_closing(handle)) {
+        uv_close(handle, cb_close);
+    }
 }
 
 void Connection::notify_closed() {
     stream_.release();
-    base_parent_->queue_confirmed_close(this);
+    {
+        std::lock_guard<std::mutex> guard{writable_mutex_};
+        closed_ = true;
+    }
+    writable_cond_.notify_all();
+    base_parent_->on_close_confirmed(*event_loop_, this);
+}
+
+bool Connection::write_chunk(BufferRef&& data) {
+    const size_t size = data.size();
+    const size_t queued = queued_bytes_.fetch_add(size) + size;
+    const bool writable = queued < event_loop_->write_high_watermark();
+    if (!writable) {
+        write_blocked_.store(true);
+    }
+    base_parent_->queue_write(this, std::move(data));
+    return writable;
+}
+
+bool Connection::write_chunk(std::stringstream& buf) {
+    return write_chunk(BufferRef::from_string(buf.str()));
 }
 
-void Connection::write_chunk(TransferBlock block) {
-    base_parent_->queue_write(this, block);
+void Connection::write_file(FileRange&& file) {
+    if (file.length > 0) {
+        base_parent_->queue_file(this, std::move(file));
+    }
 }
 
-void Connection::write_chunk(std::stringstream& buf) {
-    auto&& str = buf.str();
-    auto size = str.size();
-    char* data = new char[size];
-    std::memcpy(data, &str.front(), size);
-    TransferBlock mem_block{data, size};
-    write_chunk(mem_block);
+bool Connection::is_writable() const {
+    return queued_bytes_.load() < event_loop_->write_high_watermark();
+}
+
+void Connection::wait_writable() {
+    if (EventLoop::current() == event_loop_) {
+        //
+        // Waiting on the loop thread would block the very loop that drains us
+        //
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock{writable_mutex_};
+    write_blocked_.store(true);
+    writable_cond_.wait(lock, [this] {
+        return closed_ || queued_bytes_.load() <= event_loop_->write_low_watermark();
+    });
+}
+
+void Connection::resume_input() {
+    base_parent_->queue_resume(this);
 }
 
 void Connection::close() {
-    if (!is_closing_) {
-        is_closing_ = true;
+    if (!is_closing_.exchange(true)) {
         base_parent_->queue_close(this);
 
         const auto tp_finished = std::chrono::high_resolution_clock::now();
@@ -319,4 +1192,22 @@ Config::Config()
 :   root_(std::map<Value, Value>{}) {
 }
 
+int Config::integer(const char* key, int default_value) const {
+    auto&& dict = root_.dict();
+    auto found = dict.find(key);
+    if (found == dict.end() || !found->second.is_integer()) {
+        return default_value;
+    }
+    return found->second.integer();
+}
+
+String Config::string(const char* key, const String& default_value) const {
+    auto&& dict = root_.dict();
+    auto found = dict.find(key);
+    if (found == dict.end() || !found->second.is_str()) {
+        return default_value;
+    }
+    return found->second.str();
+}
+
 } // namespace enji
\ No newline at end of file
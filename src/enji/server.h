@@ -1,50 +1,156 @@
 #pragma once
 
 #include "common.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 
 namespace enji {
 
 class Connection;
+class Server;
 
 struct ServerOptions {
     String host;
     int port;
     int worker_threads = 0;
+    int event_loops = 1;
 };
 
-class EventLoop {
+typedef std::shared_ptr<Connection> ConnectionPtr;
+
+//
+// Connection id: slot in the loop's connection table and the generation
+// of that slot. Slots are reused, generations are not, so a handle of a
+// closed connection never resolves to a new one
+//
+struct ConnHandle {
+    uint32_t index = 0;
+    uint32_t generation = 0;
+
+    bool operator == (const ConnHandle& other) const {
+        return index == other.index && generation == other.generation;
+    }
+};
+
+std::ostream& operator << (std::ostream& out, const ConnHandle& handle);
+
+class ConnectionTable {
 public:
-    EventLoop(uv_stream_t* server);
+    ConnHandle insert(ConnectionPtr conn);
 
-    EventLoop(uv_stream_t* server, uv_loop_t* loop);
+    bool contains(ConnHandle handle) const;
 
-    uv_loop_t* loop() const { return ~loop_; }
+    Connection* get(ConnHandle handle) const;
 
-    uv_stream_t* server() const { return server_; }
+    bool erase(ConnHandle handle);
 
-    void run();
+    size_t size() const { return size_; }
 
-protected:
-    ScopePtrExit<uv_loop_t> loop_;
-    uv_stream_t* server_;
+private:
+    struct Slot {
+        ConnectionPtr conn;
+        uint32_t generation = 1;
+    };
+
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_slots_;
+    size_t size_ = 0;
 };
 
 enum class ConnEventType {
     NONE,
-    READ,
     WRITE,
+    SENDFILE,
     CLOSE,
-    CLOSE_CONFIRMED,
+    RESUME,
 };
 
 struct ConnEvent {
-    Connection* conn = nullptr;
+    ConnHandle conn;
     ConnEventType ev = ConnEventType::NONE;
-    TransferBlock buf;
+    BufferRef buf;
+    FileRange file;
 
     ConnEvent() {}
-    ConnEvent(Connection* conn, ConnEventType ev);
-    ConnEvent(Connection* conn, ConnEventType ev, TransferBlock buf);
+    ConnEvent(ConnHandle conn, ConnEventType ev);
+    ConnEvent(ConnHandle conn, ConnEventType ev, BufferRef&& buf);
+    ConnEvent(ConnHandle conn, FileRange&& file);
+};
+
+//
+// File output on the threadpool. Both keep the connection and the file
+// open until the loop gets the result
+//
+struct SendfileWork {
+    uv_work_t req;
+    ConnectionPtr conn;
+    std::shared_ptr<FileHandle> file;
+    int sock = -1;
+    int64_t offset = 0;
+    size_t length = 0;
+    size_t sent = 0;
+    int error = 0;
+};
+
+struct FileRead {
+    uv_fs_t req;
+    ConnectionPtr conn;
+    std::shared_ptr<FileHandle> file;
+    BufferRef block;
+};
+
+//
+// Pool of `worker_threads` handler threads. Every worker owns a ring of
+// connections with pending input, idle workers steal from the others and
+// park on a condition variable when there is nothing left.
+//
+class WorkerPool {
+public:
+    typedef std::function<void (ConnectionPtr&)> Handler;
+
+    WorkerPool(size_t workers, size_t queue_capacity);
+    ~WorkerPool();
+
+    void start(Handler&& handler);
+    void stop();
+
+    bool try_push(ConnectionPtr&& conn);
+
+    //
+    // After a failed try_push: the room handler runs on the next worker
+    // that takes connections off the rings
+    //
+    void on_room(std::function<void ()>&& handler) { room_handler_ = std::move(handler); }
+    void want_room() { room_wanted_.store(true); }
+
+    size_t size() const { return workers_.size(); }
+
+private:
+    void work(size_t index);
+    size_t take(size_t index, ConnectionPtr* conns, size_t max_count);
+    void park();
+
+    struct Worker : CacheAligned {
+        Worker(size_t queue_capacity) : queue{queue_capacity} {}
+
+        RingQueue<ConnectionPtr> queue;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    Handler handler_;
+    std::function<void ()> room_handler_;
+    std::atomic<bool> room_wanted_{false};
+
+    std::atomic<size_t> next_worker_{0};
+    std::atomic<size_t> pending_{0};
+    std::atomic<size_t> sleeping_{0};
+    std::atomic<bool> stopped_{false};
+
+    std::mutex park_mutex_;
+    std::condition_variable park_cond_;
 };
 
 class Config {
@@ -54,12 +160,78 @@ public:
     Value& operator [] (const char* key) { return root_[key]; }
     const Value& operator [] (const char* key) const { return root_[key]; }
 
+    int integer(const char* key, int default_value) const;
+    String string(const char* key, const String& default_value) const;
+
 private:
     Value root_;
 };
 
 extern Config ServerConfig;
 
+//
+// One libuv loop with its own listener, connections and output queue.
+// Server runs `event_loops` of them, each on its own thread.
+//
+class EventLoop : public CacheAligned {
+public:
+    EventLoop(Server* parent, size_t index, const Config& config);
+
+    uv_loop_t* loop() const { return ~loop_; }
+
+    uv_stream_t* server() const { return reinterpret_cast<uv_stream_t*>(tcp_server_.get()); }
+
+    size_t index() const { return index_; }
+
+    void listen(const sockaddr* addr, EventLoop* shared_from);
+
+    void run();
+
+    void wakeup();
+
+    void push(ConnEvent&& event);
+
+    size_t write_high_watermark() const { return write_high_watermark_; }
+    size_t write_low_watermark() const { return write_low_watermark_; }
+
+    BufferPool& read_buffers() { return read_buffers_; }
+    void release_read_buffer(char* block);
+
+    static EventLoop* current();
+
+private:
+    friend class Server;
+    friend void cb_on_connection(uv_stream_t*, int);
+    friend void cb_wakeup(uv_async_t*);
+
+    Server* parent_;
+    size_t index_;
+
+    ScopePtrExit<uv_loop_t> loop_;
+
+    std::unique_ptr<uv_tcp_t> tcp_server_;
+
+    ScopePtrExit<uv_async_t> on_loop_;
+    std::atomic<bool> wakeup_pending_{false};
+
+    // Advances the cached Date header once a second
+    ScopePtrExit<uv_timer_t> clock_;
+
+    ConnectionTable connections_;
+
+    std::vector<Connection*> pending_flush_;
+
+    RingQueue<ConnEvent> output_queue_;
+
+    // Connections with input the worker rings had no room for
+    std::deque<ConnectionPtr> stalled_;
+
+    BufferPool read_buffers_;
+
+    size_t write_high_watermark_;
+    size_t write_low_watermark_;
+};
+
 class Server {
 public:
     Server();
@@ -70,56 +242,86 @@ public:
 
     void setup(Config& config);
 
+    const Config& config() const { return config_; }
+
     void run();
 
     Server& create_connection(std::function<std::shared_ptr<Connection>()>);
 
-    EventLoop* event_loop() { return event_loop_.get(); }
+    EventLoop* event_loop();
+
+    size_t event_loops_count() const { return event_loops_.size(); }
 
-    void queue_read(Connection* conn, TransferBlock mem_block);
-    void queue_write(Connection* conn, TransferBlock mem_block);
+    void queue_read(Connection* conn, BufferRef&& data);
+    void queue_write(Connection* conn, BufferRef&& data);
+    void queue_file(Connection* conn, FileRange&& file);
     void queue_close(Connection* conn);
-    void queue_confirmed_close(Connection* conn);
+    void queue_resume(Connection* conn);
 
 private:
-    virtual void on_connection(int status);
-    virtual void on_loop();
-
+    virtual void on_connection(EventLoop& loop, int status);
+    virtual void on_loop(EventLoop& loop);
+    void on_loop_event(EventLoop& loop, ConnEvent& msg);
+    void on_close_confirmed(EventLoop& loop, Connection* conn);
+    void schedule_input(Connection* conn);
+    void push_stalled(EventLoop& loop);
+
+    friend class EventLoop;
+    friend class Connection;
     friend void cb_on_connection(uv_stream_t*, int);
-    friend void cb_idle(uv_idle_t*);
+    friend void cb_wakeup(uv_async_t*);
     
 protected:
     Config& config_;
 
-    std::unique_ptr<EventLoop> event_loop_;
+    std::vector<std::unique_ptr<EventLoop>> event_loops_;
 
-    ScopePtrExit<uv_idle_t> on_loop_;
+    std::unique_ptr<WorkerPool> workers_;
 
-    std::vector<std::shared_ptr<Connection>> connections_;
+    std::vector<std::thread> loop_threads_;
 
-    SafeQueue<ConnEvent> input_queue_;
-    SafeQueue<ConnEvent> output_queue_;
+    std::function<std::shared_ptr<Connection>()> create_connection_;
+};
 
-    std::vector<std::thread> threads_;
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+    Connection(Server* parent);
 
-    size_t counter_ = 0;
+    ConnHandle id() const { return id_; }
 
-    std::unique_ptr<uv_tcp_t> tcp_server_;
+    //
+    // Queue data for the socket. Returns false once the connection has
+    // more than the high watermark of unsent bytes: data is still queued,
+    // but producer should hold off until on_writable() or wait_writable()
+    //
+    bool write_chunk(BufferRef&& data);
+    bool write_chunk(std::stringstream& buf);
 
-    std::function<std::shared_ptr<Connection>()> create_connection_;
-};
+    //
+    // Queue a file range after the data written so far. It doesn't count
+    // against the watermarks: the loop sends it as the socket drains, with
+    // sendfile(2) on Linux and block by block reads elsewhere
+    //
+    void write_file(FileRange&& file);
 
-class Connection {
-public:
-    Connection(Server* parent, size_t id);
+    size_t queued_bytes() const { return queued_bytes_.load(); }
+    bool is_writable() const;
 
-    void write_chunk(TransferBlock block);
-    void write_chunk(std::stringstream& buf);
+    // Blocks a worker until unsent bytes drop below the low watermark
+    void wait_writable();
 
     void close();
 
+    //
+    // Runs handle_resume after the events queued so far, on the thread
+    // that handles this connection's input. Safe from any thread
+    //
+    void resume_input();
+
     uv_stream_t* sock() { return stream_.get(); }
 
+    EventLoop* event_loop() const { return event_loop_; }
+
     std::ostream& log();
 
 private:
@@ -127,29 +329,122 @@ private:
 
     void accept();
 
-    virtual void handle_input(TransferBlock data) {}
+    virtual void handle_input(const BufferRef& data) {}
+
+    //
+    // Peer shut down its side, after everything it sent went through
+    // handle_input. Closes by default, once the responses queued so far
+    // are sent
+    //
+    virtual void handle_input_end();
+
+    // handle_input, or handle_input_end for the empty end of input mark
+    void consume_input(const BufferRef& data);
+
+    // See resume_input
+    virtual void handle_resume() {}
+
+    // Loop thread: unsent bytes dropped below the low watermark again
+    virtual void on_writable() {}
+
+    bool post_input(BufferRef&& data);
+    bool post_resume();
+    void drain_input();
 
     void on_after_read(ssize_t nread, const uv_buf_t* buf);
 
+    void flush_writes();
+    bool write_pending();
+    void send_backlog();
+    bool send_file(FileRange& file);
+    bool read_file(FileRange& file);
+    void on_after_sendfile(SendfileWork* work);
+    void on_after_file_read(FileRead* read);
+    void poll_writable();
+    void on_poll_writable(int status);
+    void pause_reading();
+    void resume_reading();
+    void close_file_io();
+    void release_written(size_t bytes);
+
     void on_after_write(uv_write_t* req, int status);
-    void on_after_shutdown(uv_shutdown_t* shutdown, int status);
+    void close_handle();
     void notify_closed();
 
     friend void cb_on_connection(uv_stream_t*, int);
     friend void cb_close(uv_handle_t*);
     friend void cb_after_write(uv_write_t*, int);
-    friend void cb_after_shutdown(uv_shutdown_t*, int);
+    friend void cb_poll_writable(uv_poll_t*, int, int);
+    friend void cb_after_sendfile(uv_work_t*, int);
+    friend void cb_after_file_read(uv_fs_t*);
     friend void cb_alloc_buffer(uv_handle_t*, size_t, uv_buf_t*);
     friend void cb_after_read(uv_stream_t*, ssize_t, const uv_buf_t*);
 
 protected:
     Server* base_parent_;
 
-    std::unique_ptr<uv_stream_t> stream_;
+    EventLoop* event_loop_;
 
-    size_t id_;
+    std::unique_ptr<uv_stream_t> stream_;
 
-    bool is_closing_ = false;
+    ConnHandle id_;
+
+    std::atomic<bool> is_closing_{false};
+
+    //
+    // Loop thread only: writes gathered from the output queue and sent
+    // together as one vectored write
+    //
+    BufferChain pending_writes_;
+    bool pending_close_ = false;
+    bool pending_flush_ = false;
+    size_t writes_in_flight_ = 0;
+
+    //
+    // Loop thread only: output queued behind a file range. Memory writes
+    // go around it only while it's empty, so the socket sees everything
+    // in the order it was written
+    //
+    std::deque<OutputSegment> backlog_;
+
+    //
+    // The file at the front of backlog_ has a read or sendfile on the
+    // threadpool. Its sendfile and poll use a dup of the socket, which
+    // stays valid until that work is back even if the connection closes
+    //
+    bool file_busy_ = false;
+    bool sendfile_unsupported_ = false;
+    int sock_dup_ = -1;
+
+    // Watches sock_dup_ while sendfile waits for buffer space
+    uv_poll_t* poll_ = nullptr;
+
+    //
+    // Bytes accepted by write_chunk and not yet sent. Above the high
+    // watermark the loop stops reading from the socket, below the low
+    // one reading resumes and blocked producers are woken up
+    //
+    std::atomic<size_t> queued_bytes_{0};
+    std::atomic<bool> write_blocked_{false};
+    bool reading_paused_ = false;
+    bool read_eof_ = false;
+
+    // Loop thread only: waits in EventLoop::stalled_, not reading meanwhile
+    bool input_stalled_ = false;
+    bool closed_ = false;
+
+    std::mutex writable_mutex_;
+    std::condition_variable writable_cond_;
+
+    //
+    // Reads waiting for a worker. Only the worker that scheduled the
+    // mailbox drains it, so handle_input never runs concurrently for
+    // one connection and reads are handled in arrival order
+    //
+    std::mutex inbox_mutex_;
+    std::deque<BufferRef> inbox_;
+    bool resume_pending_ = false;
+    bool inbox_scheduled_ = false;
 
 protected:
     std::chrono::time_point<std::chrono::high_resolution_clock> tp_accepted_;
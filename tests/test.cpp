@@ -1,10 +1,1089 @@
+#include <enji/compress.h>
 #include <enji/http.h>
 #include <gtest/gtest.h>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <thread>
+
+#ifndef _WIN32
+#   include <arpa/inet.h>
+#   include <netinet/in.h>
+#   include <netinet/tcp.h>
+#   include <sys/socket.h>
+#   include <unistd.h>
+#endif
 
 TEST(common, path_join) {
     ASSERT_EQ("a/b/c", enji::path_join("a", "b", "c"));
 }
 
+TEST(common, ring_queue_batch) {
+    enji::RingQueue<std::unique_ptr<int>> queue{5};
+    ASSERT_EQ(8u, queue.capacity());
+    ASSERT_TRUE(queue.empty());
+
+    std::vector<std::unique_ptr<int>> values;
+    for (int i = 0; i < 10; ++i) {
+        values.emplace_back(new int{i});
+    }
+
+    ASSERT_EQ(8u, queue.push_batch(values.data(), values.size()));
+    ASSERT_FALSE(queue.try_push(std::move(values[8])));
+    ASSERT_TRUE(values[8] != nullptr);
+
+    std::unique_ptr<int> popped[3];
+    ASSERT_EQ(3u, queue.pop_batch(popped, 3));
+    ASSERT_EQ(0, *popped[0]);
+    ASSERT_EQ(2, *popped[2]);
+
+    ASSERT_TRUE(queue.try_push(std::move(values[8])));
+    std::unique_ptr<int> value;
+    for (int expected = 3; expected <= 8; ++expected) {
+        ASSERT_TRUE(queue.pop(value));
+        ASSERT_EQ(expected, *value);
+    }
+    ASSERT_FALSE(queue.pop(value));
+}
+
+TEST(common, buffer_pool_reuse) {
+    enji::BufferPool pool{1024, 2};
+    char* a = pool.acquire();
+    char* b = pool.acquire();
+    ASSERT_EQ(2u, pool.stats().misses);
+
+    pool.release_local(a);
+    ASSERT_EQ(a, pool.acquire());
+    ASSERT_EQ(1u, pool.stats().hits);
+
+    std::thread other{[&pool, b] { pool.release(b); }};
+    other.join();
+    ASSERT_EQ(1u, pool.stats().returned);
+    ASSERT_EQ(b, pool.acquire());
+    ASSERT_EQ(2u, pool.stats().hits);
+
+    pool.release_local(a);
+    pool.release_local(b);
+}
+
+TEST(common, buffer_ref_slices_share_storage) {
+    auto buf = enji::BufferRef::from_string("Hello, world!");
+    auto hello = buf.slice(0, 5);
+    auto world = buf.slice(7, 5);
+    buf.reset();
+
+    ASSERT_EQ("Hello", enji::String(hello.data(), hello.size()));
+    ASSERT_EQ("world", enji::String(world.data(), world.size()));
+    ASSERT_THROW(world.slice(3, 3), std::out_of_range);
+
+    enji::BufferChain chain;
+    chain.append(std::move(hello));
+    chain.append(enji::BufferRef::view("", 0));
+    chain.append(std::move(world));
+    ASSERT_EQ(2u, chain.count());
+    ASSERT_EQ(10u, chain.size());
+    ASSERT_TRUE(hello.empty());
+}
+
+TEST(common, arena_append_grows_in_place) {
+    enji::Arena arena{64};
+
+    auto head = arena.copy("Content-", 8);
+    auto joined = arena.append(head, "Type", 4);
+    EXPECT_EQ(head.data(), joined.data());
+    EXPECT_EQ("Content-Type", joined);
+
+    auto other = arena.copy("x", 1);
+    auto moved = arena.append(joined, "s", 1);
+    EXPECT_NE(joined.data(), moved.data());
+    EXPECT_EQ("Content-Types", moved);
+    EXPECT_EQ("x", other);
+
+    auto big = arena.allocate(1000);
+    EXPECT_NE(nullptr, big);
+
+    arena.reset();
+    EXPECT_EQ(0, arena.used());
+}
+
+TEST(server, connection_table_generations) {
+    enji::ConnectionTable table;
+    auto a = table.insert(nullptr);
+    auto b = table.insert(nullptr);
+    ASSERT_EQ(2u, table.size());
+    ASSERT_FALSE(a == b);
+
+    ASSERT_TRUE(table.erase(a));
+    ASSERT_FALSE(table.erase(a));
+
+    auto c = table.insert(nullptr);
+    ASSERT_EQ(a.index, c.index);
+    ASSERT_NE(a.generation, c.generation);
+    ASSERT_FALSE(table.contains(a));
+    ASSERT_TRUE(table.contains(c));
+    ASSERT_EQ(2u, table.size());
+}
+
+TEST(server, worker_pool_runs_in_parallel) {
+    const size_t workers = 4;
+    enji::WorkerPool pool{workers, 16};
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t entered = 0;
+    pool.start([&](enji::ConnectionPtr&) {
+        //
+        // Every handler holds its worker until all of them are in, which
+        // only happens when they run at the same time
+        //
+        std::unique_lock<std::mutex> lock{mutex};
+        ++entered;
+        cond.notify_all();
+        cond.wait_for(lock, std::chrono::seconds(5), [&] { return entered >= workers; });
+    });
+
+    // Idle workers park after a few spins, pushes have to wake them
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    for (size_t i = 0; i < workers; ++i) {
+        ASSERT_TRUE(pool.try_push(enji::ConnectionPtr{}));
+    }
+
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        cond.wait_for(lock, std::chrono::seconds(5), [&] { return entered >= workers; });
+        EXPECT_EQ(workers, entered);
+    }
+    pool.stop();
+}
+
+TEST(http, router_most_specific_match) {
+    enji::Router router;
+    router.add("", "/static/{path*}", 0);
+    router.add("", "/static/index.html", 1);
+    router.add("GET", "/gram/{id:int}", 2);
+    router.add("", "/gram/{name}", 3);
+    router.add("", "^/api", 4);
+    router.add("", "^/re/([a-z]+)\\.png$", 5);
+
+    enji::RouteMatch match;
+    auto find = [&](const char* method, const char* path) {
+        return router.find(method, path, std::strlen(path), match) ? match.index : enji::RouteMatch::NOT_FOUND;
+    };
+
+    EXPECT_EQ(1, find("GET", "/static/index.html"));
+    EXPECT_EQ(0, find("GET", "/static/css/main.css"));
+    EXPECT_EQ("css/main.css", match.captures[1]);
+    EXPECT_EQ(enji::RouteMatch::NOT_FOUND, find("GET", "/static/"));
+
+    EXPECT_EQ(2, find("GET", "/gram/42"));
+    EXPECT_EQ("42", match.captures[1]);
+    EXPECT_EQ(3, find("POST", "/gram/42"));
+    EXPECT_EQ(3, find("GET", "/gram/cat"));
+
+    EXPECT_EQ(4, find("GET", "/api/view"));
+    EXPECT_EQ(4, find("GET", "/apiview"));
+    EXPECT_EQ(enji::RouteMatch::NOT_FOUND, find("GET", "/ap"));
+
+    EXPECT_EQ(5, find("GET", "/re/cat.png"));
+    EXPECT_EQ("cat", match.captures[1]);
+
+    router.add("PUT", "/only/put", 6);
+    router.add("POST", "/only/put", 7);
+    router.add("PUT", "^/only/put$", 8);
+    EXPECT_EQ(enji::RouteMatch::NOT_FOUND, find("GET", "/only/put"));
+    EXPECT_TRUE(match.method_not_allowed);
+    ASSERT_EQ(2u, match.allowed_methods.size());
+    EXPECT_EQ("PUT", match.allowed_methods[0]);
+    EXPECT_EQ("POST", match.allowed_methods[1]);
+
+    EXPECT_EQ(6, find("PUT", "/only/put"));
+    EXPECT_FALSE(match.method_not_allowed);
+    EXPECT_TRUE(match.allowed_methods.empty());
+
+    router.add("", "^/api/v", 9);
+    router.add("", "^/files/", 10);
+    EXPECT_EQ(9, find("GET", "/api/view"));
+    EXPECT_EQ(4, find("GET", "/api/other"));
+    EXPECT_EQ(10, find("GET", "/files/a.txt"));
+    EXPECT_EQ(enji::RouteMatch::NOT_FOUND, find("GET", "/files"));
+}
+
+TEST(http, headers_case_insensitive) {
+    enji::HttpHeaders headers;
+    headers.add("content-type", "text/plain");
+    headers.add("X-Custom", "1");
+    headers.add("Content-Type", "ignored");
+
+    EXPECT_EQ(enji::HttpHeader::CONTENT_TYPE, enji::http_header_id("CONTENT-TYPE"));
+    EXPECT_EQ(enji::HttpHeader::UNKNOWN, enji::http_header_id("X-Custom"));
+
+    EXPECT_EQ("text/plain", headers.get(enji::HttpHeader::CONTENT_TYPE));
+    EXPECT_EQ("text/plain", headers.get("Content-TYPE"));
+    EXPECT_EQ("1", headers.get("x-custom"));
+    EXPECT_FALSE(headers.has(enji::HttpHeader::RANGE));
+    EXPECT_EQ(3, headers.size());
+
+    headers.clear();
+    EXPECT_TRUE(headers.get(enji::HttpHeader::CONTENT_TYPE).empty());
+}
+
+TEST(http, multipart_parser_byte_by_byte) {
+    const enji::String body =
+        "preamble\r\n"
+        "--XyZ\r\n"
+        "Content-Disposition: form-data; name=\"field\"\r\n"
+        "\r\n"
+        "value\r\n"
+        "--XyZ\r\n"
+        "content-disposition: form-data; name=\"file\"; filename=\"a.txt\"\r\n"
+        "Content-Type: text/plain\r\n"
+        "\r\n"
+        "line\r\n--Xy\r\r\n"
+        "--XyZ--\r\n";
+
+    EXPECT_EQ("XyZ", enji::MultipartParser::boundary("multipart/form-data; boundary=\"XyZ\""));
+
+    enji::MultipartParser parser{"XyZ"};
+    std::vector<enji::MultipartPart> parts;
+    std::vector<enji::String> bodies;
+    parser.on_part_begin([&](const enji::MultipartPart& part) { parts.push_back(part); bodies.emplace_back(); });
+    parser.on_part_data([&](const char* data, size_t size) { bodies.back().append(data, size); });
+
+    for (char c : body) {
+        ASSERT_TRUE(parser.feed(&c, 1));
+    }
+    ASSERT_TRUE(parser.finish());
+
+    ASSERT_EQ(2, parts.size());
+    EXPECT_EQ("field", parts[0].name);
+    EXPECT_EQ("value", bodies[0]);
+    EXPECT_EQ("a.txt", parts[1].filename);
+    EXPECT_EQ("text/plain", parts[1].content_type);
+    EXPECT_EQ("line\r\n--Xy\r", bodies[1]);
+
+    enji::MultipartLimits limits;
+    limits.max_part_size = 3;
+    enji::MultipartParser limited{"XyZ", limits};
+    EXPECT_FALSE(limited.feed(body.data(), body.size()));
+    EXPECT_TRUE(limited.too_large());
+}
+
+TEST(common, http_date_round_trip) {
+    EXPECT_EQ("Sun, 06 Nov 1994 08:49:37 GMT", enji::format_http_date(784111777));
+    EXPECT_EQ("Thu, 01 Jan 1970 00:00:00 GMT", enji::format_http_date(0));
+
+    int64_t seconds = 0;
+    ASSERT_TRUE(enji::parse_http_date("Tue, 29 Feb 2028 23:59:59 GMT", seconds));
+    EXPECT_EQ("Tue, 29 Feb 2028 23:59:59 GMT", enji::format_http_date(seconds));
+    EXPECT_FALSE(enji::parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT", seconds));
+}
+
+TEST(http, file_cache_revalidates) {
+    const enji::String path = enji::path_join(::testing::TempDir(), "enji-cache-test.css");
+    std::ofstream{path.c_str(), std::ios::binary} << "body{}";
+
+    enji::FileCacheOptions options;
+    options.check_interval_ms = 0;
+    enji::FileCache cache{options};
+
+    auto first = cache.get(path);
+    ASSERT_TRUE(first);
+    ASSERT_TRUE(first->has_body);
+    EXPECT_EQ(enji::StringView{"body{}"}, (enji::StringView{first->body.data(), first->body.size()}));
+    EXPECT_EQ(enji::StringView{"text/css; charset=utf-8"}, first->content_type);
+    EXPECT_EQ(first, cache.get(path));
+
+    std::ofstream{path.c_str(), std::ios::binary} << "body{color:red}";
+    auto second = cache.get(path);
+    ASSERT_TRUE(second);
+    EXPECT_NE(first->etag, second->etag);
+    EXPECT_EQ(1, cache.size());
+
+    std::remove(path.c_str());
+    EXPECT_FALSE(cache.get(path));
+    EXPECT_EQ(0, cache.size());
+}
+
+TEST(http, file_cache_gzip_variant) {
+    EXPECT_TRUE(enji::accepts_encoding("gzip, deflate, br", "br"));
+    EXPECT_TRUE(enji::accepts_encoding("deflate, *;q=0.5", "gzip"));
+    EXPECT_FALSE(enji::accepts_encoding("gzip;q=0, *", "gzip"));
+    EXPECT_FALSE(enji::accepts_encoding("identity", "gzip"));
+
+    const enji::String path = enji::path_join(::testing::TempDir(), "enji-gzip-test.js");
+    std::ofstream{path.c_str(), std::ios::binary} << enji::String(4096, 'a');
+
+    enji::FileCacheOptions options;
+    options.gzip_level = 6;
+    enji::FileCache cache{options};
+
+    auto file = cache.get(path);
+    ASSERT_TRUE(file);
+    ASSERT_TRUE(file->gzip);
+    EXPECT_FALSE(file->br);
+    EXPECT_LT(file->gzip->size, file->size);
+    EXPECT_NE(file->etag, file->gzip->etag);
+    EXPECT_EQ(file->gzip.get(), &file->variant("br;q=0, gzip"));
+    EXPECT_EQ(file.get(), &file->variant("br"));
+    EXPECT_EQ(file->body.size() + file->gzip->body.size(), cache.cached_bytes());
+
+    std::remove(path.c_str());
+}
+
+TEST(http, file_cache_maps_large_files) {
+    const enji::String path = enji::path_join(::testing::TempDir(), "enji-mmap-test.bin");
+    std::ofstream{path.c_str(), std::ios::binary} << enji::String(8192, 'x');
+
+    enji::FileCacheOptions options;
+    options.check_interval_ms = 0;
+    options.max_file_size = 1024;
+    options.max_mapped_file_size = 16384;
+    enji::FileCache cache{options};
+
+    auto first = cache.get(path);
+    ASSERT_TRUE(first);
+    ASSERT_TRUE(first->mapped);
+    EXPECT_EQ(8192u, cache.mapped_bytes());
+    EXPECT_EQ(0u, cache.cached_bytes());
+    enji::BufferRef slice = first->body.slice(8000, 192);
+
+    // New version gets its own mapping, slices of the old one stay valid
+    std::remove(path.c_str());
+    std::ofstream{path.c_str(), std::ios::binary} << enji::String(4096, 'y');
+    auto second = cache.get(path);
+    ASSERT_TRUE(second);
+    EXPECT_EQ(4096u, cache.mapped_bytes());
+    first.reset();
+    EXPECT_EQ(enji::String(192, 'x'), enji::String(slice.data(), slice.size()));
+
+    std::remove(path.c_str());
+}
+
+TEST(http, parse_byte_ranges) {
+    std::vector<enji::ByteRange> ranges;
+    ASSERT_TRUE(enji::parse_byte_ranges("bytes=0-99, 200-, -50", 1000, ranges));
+    ASSERT_EQ(3u, ranges.size());
+    EXPECT_EQ(0u, ranges[0].offset);
+    EXPECT_EQ(100u, ranges[0].length);
+    EXPECT_EQ(200u, ranges[1].offset);
+    EXPECT_EQ(800u, ranges[1].length);
+    EXPECT_EQ(950u, ranges[2].offset);
+    EXPECT_EQ(50u, ranges[2].length);
+
+    ASSERT_TRUE(enji::parse_byte_ranges("bytes=500-5000", 1000, ranges));
+    ASSERT_EQ(1u, ranges.size());
+    EXPECT_EQ(500u, ranges[0].length);
+
+    // Unsatisfiable
+    ASSERT_TRUE(enji::parse_byte_ranges("bytes=1000-", 1000, ranges));
+    EXPECT_TRUE(ranges.empty());
+
+    // Ignored
+    EXPECT_FALSE(enji::parse_byte_ranges("bytes=5-1", 1000, ranges));
+    EXPECT_FALSE(enji::parse_byte_ranges("items=0-1", 1000, ranges));
+    EXPECT_FALSE(enji::parse_byte_ranges("bytes=0-999, 0-999", 1000, ranges));
+}
+
+TEST(http, status_lines_and_date) {
+    EXPECT_EQ(enji::StringView{"HTTP/1.1 404 Not Found\r\n"}, enji::http_status_line(404));
+    EXPECT_EQ(enji::StringView{"HTTP/1.1 206 Partial Content\r\n"}, enji::http_status_line(206));
+    EXPECT_TRUE(enji::http_status_line(299).empty());
+    EXPECT_TRUE(enji::http_status_line(42).empty());
+
+    enji::update_http_clock();
+    int64_t seconds = 0;
+    ASSERT_TRUE(enji::parse_http_date(enji::cached_http_date(), seconds));
+    EXPECT_LE(std::abs(seconds - int64_t(std::time(nullptr))), 1);
+}
+
+#ifndef _WIN32
+
+namespace {
+
+const int TEST_PORT = 31380;
+const char TEST_TEXT[] = "text body\n";
+
+enji::String test_file_path() {
+    return enji::path_join(::testing::TempDir(), "enji-served.txt");
+}
+
+void text_handler(const enji::HttpRequest&, enji::HttpResponse& out) {
+    out.body(TEST_TEXT);
+}
+
+void file_handler(const enji::HttpRequest&, enji::HttpResponse& out) {
+    enji::response_file(test_file_path(), out);
+}
+
+// Two chunks flushed separately, the last one sent on close
+void chunks_handler(const enji::HttpRequest&, enji::HttpResponse& out) {
+    out.chunked();
+    out.body("first");
+    out.flush();
+    out.body("second!");
+}
+
+// Size and checksum of the plain (not multipart) request body
+void body_handler(const enji::HttpRequest& req, enji::HttpResponse& out) {
+    uint64_t sum = 0;
+    for (char c : req.body()) {
+        sum = sum * 31 + static_cast<unsigned char>(c);
+    }
+    out.body(std::to_string(req.body().size()) + " " + std::to_string(sum));
+}
+
+// Answers with the number of body chunks, body size and checksum
+void stream_handler(const enji::HttpRequest&, enji::HttpBodyStream& stream) {
+    struct Seen {
+        size_t chunks = 0;
+        size_t size = 0;
+        uint64_t sum = 0;
+    };
+    auto seen = std::make_shared<Seen>();
+
+    stream.on_data([seen](const char* data, size_t size) {
+        ++seen->chunks;
+        seen->size += size;
+        for (size_t i = 0; i < size; ++i) {
+            seen->sum = seen->sum * 31 + static_cast<unsigned char>(data[i]);
+        }
+    });
+    stream.on_complete([seen](const enji::HttpRequest&, enji::HttpResponse& out) {
+        out.body(std::to_string(seen->chunks) + " " + std::to_string(seen->size) + " " + std::to_string(seen->sum));
+    });
+}
+
+// Finished later from another thread, gzipped for clients that ask
+void later_handler(const enji::HttpRequest&, enji::HttpResponse& out) {
+    std::shared_ptr<enji::HttpResponse> deferred = out.defer();
+    std::thread{[deferred] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        deferred->add_header("Content-Type", "text/plain");
+        deferred->body(enji::String(4096, 'x'));
+        deferred->close();
+    }}.detach();
+}
+
+// Compressible size, with the Content-Type asked for in X-Type
+void typed_handler(const enji::HttpRequest& req, enji::HttpResponse& out) {
+    const enji::StringView type = req.header("X-Type");
+    if (!type.empty()) {
+        out.add_header("Content-Type", type);
+    }
+    out.body(enji::String(4096, 'x'));
+}
+
+//
+// Test servers run on background threads for the whole run. Server has
+// no stop(), so they are leaked and go away with the process
+//
+void start_server(enji::Config* config, std::vector<enji::HttpRoute>&& routes) {
+    auto server = new enji::HttpServer{*config};
+    server->routes(std::move(routes));
+    std::thread{[server] { server->run(); }}.detach();
+}
+
+void start_test_server() {
+    static std::once_flag started;
+    std::call_once(started, [] {
+        std::ofstream{test_file_path().c_str(), std::ios::binary} << "hello static file\n";
+
+        auto config = new enji::Config;
+        (*config)["port"] = TEST_PORT;
+        (*config)["worker_threads"] = 1;
+
+        start_server(config, {
+            {"^/text", text_handler},
+            {"^/file", file_handler},
+            {"^/body", body_handler},
+            {"^/later", later_handler},
+            {"^/chunks", chunks_handler},
+        });
+    });
+}
+
+size_t count_of(const enji::String& str, const enji::String& what) {
+    size_t count = 0;
+    for (size_t pos = str.find(what); pos != enji::String::npos; pos = str.find(what, pos + 1)) {
+        ++count;
+    }
+    return count;
+}
+
+// -1 when nothing listens on `port`
+int connect_to(int port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(uint16_t(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void send_all(int sock, const enji::String& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        const ssize_t written = send(sock, data.data() + sent, data.size() - sent, 0);
+        if (written <= 0) {
+            break;
+        }
+        sent += size_t(written);
+    }
+}
+
+// Reads until the server closes the connection, then closes it too
+enji::String read_all(int sock) {
+    enji::String response;
+    char buf[16 * 1024];
+    ssize_t got;
+    while ((got = recv(sock, buf, sizeof(buf), 0)) > 0) {
+        response.append(buf, size_t(got));
+    }
+    ::close(sock);
+    return response;
+}
+
+// Sends `request` on a new connection, reads until the server closes it
+enji::String exchange(const enji::String& request, int port = TEST_PORT) {
+    start_test_server();
+
+    const int sock = connect_to(port);
+    if (sock < 0) {
+        return enji::String{};
+    }
+    send_all(sock, request);
+    return read_all(sock);
+}
+
+} // namespace
+
+TEST(http, head_responses_have_no_body) {
+    const enji::String response = exchange(
+        "HEAD /file HTTP/1.1\r\nHost: test\r\n\r\n"
+        "HEAD /text HTTP/1.1\r\nHost: test\r\n\r\n"
+        "GET /text HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n");
+
+    const size_t file_head_end = response.find("\r\n\r\n");
+    ASSERT_NE(enji::String::npos, file_head_end);
+    EXPECT_NE(enji::String::npos, response.substr(0, file_head_end + 2).find("Content-length: 18\r\n"));
+
+    const size_t text_head = file_head_end + 4;
+    ASSERT_EQ(0u, response.compare(text_head, 15, "HTTP/1.1 200 OK"));
+    const size_t text_head_end = response.find("\r\n\r\n", text_head);
+    ASSERT_NE(enji::String::npos, text_head_end);
+    EXPECT_NE(enji::String::npos, response.substr(text_head, text_head_end + 2 - text_head).find("Content-length: 10\r\n"));
+
+    const size_t get = text_head_end + 4;
+    ASSERT_EQ(0u, response.compare(get, 15, "HTTP/1.1 200 OK"));
+    EXPECT_EQ(enji::String{TEST_TEXT}, response.substr(response.size() - 10));
+    EXPECT_EQ(response.size() - 10, response.find("\r\n\r\n", get) + 4);
+}
+
+TEST(http, chunked_responses) {
+    //
+    // Each flush is one chunk, close() ends the body with the last chunk
+    // and the connection carries on with the next response
+    //
+    const enji::String response = exchange(
+        "GET /chunks HTTP/1.1\r\nHost: test\r\n\r\n"
+        "GET /text HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n");
+
+    const size_t head_end = response.find("\r\n\r\n");
+    ASSERT_NE(enji::String::npos, head_end);
+    const enji::String head = response.substr(0, head_end + 2);
+    EXPECT_EQ(0u, head.compare(0, 15, "HTTP/1.1 200 OK"));
+    EXPECT_NE(enji::String::npos, head.find("Transfer-Encoding: chunked\r\n"));
+    EXPECT_EQ(enji::String::npos, head.find("Content-length"));
+
+    const enji::String chunks = "5\r\nfirst\r\n7\r\nsecond!\r\n0\r\n\r\n";
+    EXPECT_EQ(chunks, response.substr(head_end + 4, chunks.size()));
+
+    const size_t next = head_end + 4 + chunks.size();
+    ASSERT_EQ(0u, response.compare(next, 15, "HTTP/1.1 200 OK"));
+    EXPECT_EQ(enji::String{TEST_TEXT}, response.substr(response.size() - 10));
+
+    //
+    // HTTP/1.0 has no chunked coding: the raw body is ended by closing
+    // the connection, even when the client asked to keep it
+    //
+    const enji::String fallback = exchange(
+        "GET /chunks HTTP/1.0\r\nHost: test\r\nConnection: keep-alive\r\n\r\n");
+
+    const size_t fallback_head_end = fallback.find("\r\n\r\n");
+    ASSERT_NE(enji::String::npos, fallback_head_end);
+    const enji::String fallback_head = fallback.substr(0, fallback_head_end + 2);
+    EXPECT_EQ(enji::String::npos, fallback_head.find("Transfer-Encoding"));
+    EXPECT_EQ(enji::String::npos, fallback_head.find("Content-length"));
+    EXPECT_NE(enji::String::npos, fallback_head.find("Connection: close\r\n"));
+    EXPECT_EQ("firstsecond!", fallback.substr(fallback_head_end + 4));
+}
+
+TEST(http, half_closed_client_gets_responses) {
+    start_test_server();
+
+    //
+    // Requests are still on the worker when the loop sees the end of
+    // input, the connection must close only after their responses
+    //
+    for (int i = 0; i < 20; ++i) {
+        const int sock = connect_to(TEST_PORT);
+        ASSERT_LE(0, sock);
+        send_all(sock, "GET /text HTTP/1.0\r\n\r\n");
+        shutdown(sock, SHUT_WR);
+        const enji::String response = read_all(sock);
+        ASSERT_EQ(0u, response.compare(0, 15, "HTTP/1.1 200 OK"));
+        EXPECT_EQ(enji::String{TEST_TEXT}, response.substr(response.size() - 10));
+    }
+
+    const int sock = connect_to(TEST_PORT);
+    ASSERT_LE(0, sock);
+    send_all(sock, "GET /text HTTP/1.1\r\nHost: test\r\n\r\nGET /file HTTP/1.1\r\nHost: test\r\n\r\n");
+    shutdown(sock, SHUT_WR);
+    const enji::String response = read_all(sock);
+    const size_t second = response.find("HTTP/1.1 200 OK", 1);
+    ASSERT_NE(enji::String::npos, second);
+    EXPECT_EQ(enji::String{"hello static file\n"}, response.substr(response.size() - 18));
+}
+
+TEST(http, deferred_responses_keep_order) {
+    const int port = TEST_PORT + 2;
+    static std::once_flag started;
+    std::call_once(started, [port] {
+        start_test_server();
+
+        //
+        // Handlers on the loop thread, and a file cache that never answers
+        // from memory: every file response is deferred to the threadpool
+        //
+        auto config = new enji::Config;
+        (*config)["port"] = port;
+        (*config)["worker_threads"] = 0;
+        (*config)["static_cache_check_ms"] = 0;
+        (*config)["gzip_responses"] = 1;
+        start_server(config, {
+            {"^/text", text_handler},
+            {"^/file", file_handler},
+            {"^/later", later_handler},
+        });
+    });
+
+    const int sock = connect_to(port);
+    ASSERT_LE(0, sock);
+    send_all(sock,
+        "GET /file HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+        "GET /text HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+        "GET /later HTTP/1.0\r\nConnection: keep-alive\r\nAccept-Encoding: gzip\r\n\r\n"
+        "GET /file HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+        "GET /text HTTP/1.0\r\n\r\n");
+    const enji::String response = read_all(sock);
+
+    std::vector<enji::String> heads;
+    std::vector<enji::String> bodies;
+    size_t pos = 0;
+    size_t end;
+    while ((end = response.find("\r\n\r\n", pos)) != enji::String::npos) {
+        heads.push_back(response.substr(pos, end + 2 - pos));
+        const size_t length = heads.back().find("Content-length: ");
+        ASSERT_NE(enji::String::npos, length);
+        const size_t body_size = std::strtoul(heads.back().c_str() + length + 16, nullptr, 10);
+        bodies.push_back(response.substr(end + 4, body_size));
+        pos = end + 4 + body_size;
+    }
+    ASSERT_EQ(5u, heads.size());
+    EXPECT_EQ(response.size(), pos);
+
+    EXPECT_EQ("hello static file\n", bodies[0]);
+    EXPECT_EQ(TEST_TEXT, bodies[1]);
+    EXPECT_LT(bodies[2].size(), 4096u);
+    EXPECT_EQ("hello static file\n", bodies[3]);
+    EXPECT_EQ(TEST_TEXT, bodies[4]);
+    for (size_t i = 0; i < 4; ++i) {
+        EXPECT_NE(enji::String::npos, heads[i].find("\r\nConnection: keep-alive\r\n")) << heads[i];
+    }
+    // Request headers are still there when the deferred response ends
+    EXPECT_NE(enji::String::npos, heads[2].find("\r\nContent-Encoding: gzip\r\n"));
+    EXPECT_NE(enji::String::npos, heads[4].find("\r\nConnection: close\r\n"));
+
+    // With a worker the resume goes through the connection's mailbox
+    const enji::String pipelined = exchange(
+        "GET /later HTTP/1.1\r\nHost: test\r\n\r\n"
+        "GET /text HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n");
+    const size_t text = pipelined.find("\r\n\r\n" + enji::String(4096, 'x') + "HTTP/1.1 200 OK");
+    ASSERT_NE(enji::String::npos, text);
+    EXPECT_EQ(enji::String{TEST_TEXT}, pipelined.substr(pipelined.size() - 10));
+}
+
+TEST(http, gzip_only_compressible_types) {
+    const int port = TEST_PORT + 6;
+    static std::once_flag started;
+    std::call_once(started, [port] {
+        auto config = new enji::Config;
+        (*config)["port"] = port;
+        (*config)["worker_threads"] = 1;
+        (*config)["gzip_responses"] = 1;
+        start_server(config, {
+            {"^/typed", typed_handler},
+        });
+    });
+
+    auto get = [port](const enji::String& headers) {
+        return exchange("GET /typed HTTP/1.1\r\nHost: test\r\nAccept-Encoding: gzip\r\n" + headers
+            + "Connection: close\r\n\r\n", port);
+    };
+
+    const enji::String text = get("X-Type: text/html\r\n");
+    EXPECT_NE(enji::String::npos, text.find("\r\nContent-Encoding: gzip\r\n"));
+    EXPECT_NE(enji::String::npos, text.find("\r\nVary: Accept-Encoding\r\n"));
+
+    for (const char* headers : {"X-Type: image/png\r\n", ""}) {
+        const enji::String raw = get(headers);
+        EXPECT_EQ(enji::String::npos, raw.find("Content-Encoding")) << headers;
+        EXPECT_EQ(enji::String::npos, raw.find("Vary")) << headers;
+        EXPECT_EQ(enji::String(4096, 'x'), raw.substr(raw.size() - 4096)) << headers;
+    }
+}
+
+int start_limited_server() {
+    const int port = TEST_PORT + 5;
+    static std::once_flag started;
+    std::call_once(started, [port] {
+        auto config = new enji::Config;
+        (*config)["port"] = port;
+        (*config)["worker_threads"] = 1;
+        (*config)["max_body_size"] = 1024;
+        start_server(config, {
+            {"^/body", body_handler},
+            enji::HttpRoute::streaming("POST", "/stream", stream_handler),
+        });
+    });
+    return port;
+}
+
+TEST(http, max_body_size) {
+    const int port = start_limited_server();
+
+    const enji::String small = exchange(
+        "POST /body HTTP/1.1\r\nHost: test\r\nConnection: close\r\nContent-Length: 3\r\n\r\nabc", port);
+    EXPECT_EQ(0u, small.compare(0, 15, "HTTP/1.1 200 OK"));
+
+    // Refused from the header, before the body is sent
+    const enji::String declared = exchange(
+        "POST /body HTTP/1.1\r\nHost: test\r\nContent-Length: 1025\r\n\r\n", port);
+    EXPECT_EQ(0u, declared.compare(0, 30, "HTTP/1.1 413 Payload Too Large"));
+
+    // Chunked bodies are counted as they come
+    const enji::String chunk(600, 'c');
+    const enji::String chunked = exchange(
+        "POST /body HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "258\r\n" + chunk + "\r\n258\r\n" + chunk + "\r\n0\r\n\r\n", port);
+    EXPECT_EQ(0u, chunked.compare(0, 30, "HTTP/1.1 413 Payload Too Large"));
+}
+
+TEST(http, method_not_allowed_lists_methods) {
+    const enji::String response = exchange(
+        "GET /stream HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n", start_limited_server());
+    EXPECT_EQ(0u, response.compare(0, 31, "HTTP/1.1 405 Method Not Allowed"));
+    EXPECT_NE(enji::String::npos, response.find("\r\nAllow: POST\r\n"));
+}
+
+TEST(http, streaming_route_gets_body_in_chunks) {
+    const int sock = connect_to(start_limited_server());
+    ASSERT_LE(0, sock);
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    send_all(sock, "POST /stream HTTP/1.1\r\nHost: test\r\nConnection: close\r\nContent-Length: 1000\r\n\r\n");
+    uint64_t sum = 0;
+    for (int piece = 0; piece < 10; ++piece) {
+        const enji::String data(100, char('a' + piece));
+        for (char c : data) {
+            sum = sum * 31 + static_cast<unsigned char>(c);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        send_all(sock, data);
+    }
+
+    const enji::String response = read_all(sock);
+    ASSERT_EQ(0u, response.compare(0, 15, "HTTP/1.1 200 OK"));
+    const enji::String body = response.substr(response.find("\r\n\r\n") + 4);
+    EXPECT_LT(1, std::atoi(body.c_str()));
+    EXPECT_EQ(" 1000 " + std::to_string(sum), body.substr(body.find(' ')));
+}
+
+TEST(http, body_spanning_many_reads) {
+    // Far more than one read buffer, so the body is joined read by read
+    enji::String body(8 * 1024 * 1024, '\0');
+    uint64_t sum = 0;
+    for (size_t i = 0; i < body.size(); ++i) {
+        body[i] = char('a' + i % 26);
+        sum = sum * 31 + static_cast<unsigned char>(body[i]);
+    }
+
+    const enji::String response = exchange(
+        "POST /body HTTP/1.1\r\nHost: test\r\nConnection: close\r\nContent-Length: "
+        + std::to_string(body.size()) + "\r\n\r\n" + body);
+
+    ASSERT_EQ(0u, response.compare(0, 15, "HTTP/1.1 200 OK"));
+    const enji::String expected = std::to_string(body.size()) + " " + std::to_string(sum);
+    EXPECT_EQ(expected, response.substr(response.size() - expected.size()));
+}
+
+TEST(http, canned_not_found) {
+    const enji::String response = exchange(
+        "GET /missing HTTP/1.1\r\nHost: test\r\n\r\n"
+        "GET /missing HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+        "GET /missing HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n");
+
+    std::vector<enji::String> heads;
+    size_t pos = 0;
+    size_t end;
+    while ((end = response.find("\r\n\r\n", pos)) != enji::String::npos) {
+        heads.push_back(response.substr(pos, end + 2 - pos));
+        pos = end + 4;
+    }
+    ASSERT_EQ(3u, heads.size());
+    EXPECT_EQ(response.size(), pos);
+
+    for (const enji::String& head : heads) {
+        EXPECT_EQ(0u, head.compare(0, 22, "HTTP/1.1 404 Not Found"));
+        EXPECT_NE(enji::String::npos, head.find("\r\nDate: "));
+        EXPECT_NE(enji::String::npos, head.find("\r\nContent-length: 0\r\n"));
+    }
+    EXPECT_EQ(enji::String::npos, heads[0].find("Connection:"));
+    EXPECT_NE(enji::String::npos, heads[1].find("\r\nConnection: keep-alive\r\n"));
+    EXPECT_NE(enji::String::npos, heads[2].find("\r\nConnection: close\r\n"));
+}
+
+TEST(http, input_waits_for_full_worker_rings) {
+    const int port = TEST_PORT + 1;
+    static std::once_flag started;
+    std::call_once(started, [port] {
+        //
+        // Rings of two slots for one worker and a two event output queue:
+        // most reads find no room and wait on their loop
+        //
+        auto config = new enji::Config;
+        (*config)["port"] = port;
+        (*config)["worker_threads"] = 1;
+        (*config)["queue_capacity"] = 2;
+        start_server(config, {
+            {"^/text", text_handler},
+        });
+    });
+
+    const size_t clients = 16;
+    const size_t requests = 50;
+    enji::String pipeline;
+    for (size_t i = 1; i < requests; ++i) {
+        pipeline += "GET /text HTTP/1.1\r\nHost: test\r\n\r\n";
+    }
+    pipeline += "GET /text HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+
+    std::vector<size_t> answered(clients);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < clients; ++i) {
+        threads.emplace_back([&, i] {
+            const int sock = connect_to(port);
+            if (sock >= 0) {
+                send_all(sock, pipeline);
+                answered[i] = count_of(read_all(sock), "HTTP/1.1 200 OK");
+            }
+        });
+    }
+    for (auto&& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < clients; ++i) {
+        EXPECT_EQ(requests, answered[i]);
+    }
+}
+
+namespace {
+
+const size_t FLOOD_SIZE = 32 * 1024 * 1024;
+
+struct WatermarkState {
+    std::atomic<bool> flood_writable{true};
+    std::atomic<int> writable_calls{0};
+    std::atomic<int> inputs{0};
+    std::atomic<bool> writable_before_input{false};
+    std::atomic<bool> woke{false};
+};
+
+WatermarkState watermark;
+
+//
+// Writes far more than the socket takes on 'f', then either waits for
+// the next input ('f') or blocks in wait_writable ('w')
+//
+class FloodConnection : public enji::Connection {
+public:
+    using enji::Connection::Connection;
+
+private:
+    void handle_input(const enji::BufferRef& data) override {
+        if (++watermark.inputs > 1) {
+            watermark.writable_before_input = watermark.writable_calls.load() > 0;
+            write_chunk(enji::BufferRef::view("done", 4));
+            close();
+            return;
+        }
+
+        watermark.flood_writable = write_chunk(enji::BufferRef::allocate(FLOOD_SIZE));
+        if (data.data()[0] == 'w') {
+            wait_writable();
+            watermark.woke = true;
+        }
+    }
+
+    void on_writable() override {
+        ++watermark.writable_calls;
+    }
+};
+
+int start_flood_server() {
+    const int port = TEST_PORT + 3;
+    static std::once_flag started;
+    std::call_once(started, [port] {
+        auto config = new enji::Config;
+        (*config)["port"] = port;
+        (*config)["worker_threads"] = 1;
+        (*config)["write_high_watermark"] = 64 * 1024;
+        (*config)["write_low_watermark"] = 16 * 1024;
+
+        auto server = new enji::Server{*config};
+        server->create_connection([server] { return std::make_shared<FloodConnection>(server); });
+        std::thread{[server] { server->run(); }}.detach();
+    });
+    return port;
+}
+
+} // namespace
+
+TEST(server, write_watermarks_pause_reading) {
+    const int sock = connect_to(start_flood_server());
+    ASSERT_LE(0, sock);
+
+    send_all(sock, "f");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_FALSE(watermark.flood_writable.load());
+
+    // Client doesn't read, so the connection doesn't either
+    send_all(sock, "f");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(1, watermark.inputs.load());
+    EXPECT_EQ(0, watermark.writable_calls.load());
+
+    // Reading it all drops the queue below the low watermark
+    const enji::String response = read_all(sock);
+    EXPECT_EQ(FLOOD_SIZE + 4, response.size());
+    EXPECT_EQ("done", response.substr(response.size() - 4));
+    EXPECT_EQ(2, watermark.inputs.load());
+    EXPECT_TRUE(watermark.writable_before_input.load());
+}
+
+TEST(server, wait_writable_wakes_on_close) {
+    watermark.inputs = 0;
+    watermark.flood_writable = true;
+
+    const int sock = connect_to(start_flood_server());
+    ASSERT_LE(0, sock);
+    send_all(sock, "w");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_FALSE(watermark.flood_writable.load());
+    EXPECT_FALSE(watermark.woke.load());
+
+    ::close(sock);
+    for (int i = 0; i < 500 && !watermark.woke.load(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_TRUE(watermark.woke.load());
+}
+
+namespace {
+
+//
+// Collects its input, then answers with the number of handle_input calls
+// and everything it got once a '.' arrives. Calls that overlap are counted
+//
+class OrderConnection : public enji::Connection {
+public:
+    using enji::Connection::Connection;
+
+private:
+    void handle_input(const enji::BufferRef& data) override {
+        if (inside_.exchange(true)) {
+            ++overlaps_;
+        }
+        std::this_thread::yield();
+        received_.append(data.data(), data.size());
+        ++calls_;
+        inside_ = false;
+
+        if (received_.back() == '.') {
+            write_chunk(enji::BufferRef::from_string(std::to_string(overlaps_.load()) + " "
+                + std::to_string(calls_) + " " + received_));
+            close();
+        }
+    }
+
+    std::atomic<bool> inside_{false};
+    std::atomic<int> overlaps_{0};
+    size_t calls_ = 0;
+    enji::String received_;
+};
+
+} // namespace
+
+TEST(server, input_is_serialized_per_connection) {
+    const int port = TEST_PORT + 4;
+    static std::once_flag started;
+    std::call_once(started, [port] {
+        auto config = new enji::Config;
+        (*config)["port"] = port;
+        (*config)["worker_threads"] = 4;
+
+        auto server = new enji::Server{*config};
+        server->create_connection([server] { return std::make_shared<OrderConnection>(server); });
+        std::thread{[server] { server->run(); }}.detach();
+    });
+
+    const int sock = connect_to(port);
+    ASSERT_LE(0, sock);
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // Small writes with pauses, so they arrive as many separate reads
+    enji::String sent;
+    for (int i = 0; i < 2000; ++i) {
+        const enji::String piece = std::to_string(i) + ",";
+        send_all(sock, piece);
+        sent += piece;
+        if (i % 20 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    send_all(sock, ".");
+    sent += ".";
+
+    const enji::String response = read_all(sock);
+    const size_t calls_end = response.find(' ', 2);
+    ASSERT_NE(enji::String::npos, calls_end);
+    EXPECT_EQ("0 ", response.substr(0, 2));
+    EXPECT_LT(10, std::atoi(response.c_str() + 2));
+    EXPECT_EQ(sent, response.substr(calls_end + 1));
+}
+
+#endif
+
 int main(int argc, char* argv[]) {
     ::testing::InitGoogleTest(&argc, argv);
     int result = RUN_ALL_TESTS();